@@ -0,0 +1,141 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* AG walker. Goes through the AG headers, the free space btrees, the free
+   list and the inode btrees of one AG, and reports what it finds to the
+   callbacks of an agwalk_t. Damage is warned about, counted and stepped
+   over. */
+
+#include "xfsr.h"
+#include <string.h>
+
+#define AGFL_V5_HDR 36
+
+static uint64_t agbno_to_blkadr(uint64_t ag, uint32_t agbno)
+{
+	return ag*GET32(g_sb.sb_agblocks) + agbno;
+}
+
+static void meta(agwalk_t *w, uint64_t blkadr, uint64_t len)
+{
+	if(w->meta) w->meta(blkadr, len);
+}
+
+/* Walks a short form AG btree, reporting its blocks as metadata and calling
+   rec() for each leaf record. */
+static void walk_sbtree(FILE *fp, agwalk_t *w, uint64_t ag, uint32_t agbno, int level, uint32_t magic, uint32_t magic3,
+	unsigned recsize, unsigned keysize, void (*rec)(agwalk_t *w, uint64_t ag, const unsigned char *r))
+{
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	unsigned hdr = g_v5 ? 0x38 : 0x10;
+	unsigned char buf[blocksize];
+
+	if(level < 0 || level >= EXTMAP_MAXLEVELS) {
+		eprintf(WARN, "AG %llu: bogus btree level %d", ag, level);
+		w->bad++;
+		return;
+	}
+	if(agbno == 0 || agbno >= GET32(g_sb.sb_agblocks)) {
+		eprintf(WARN, "AG %llu: btree pointer 0x%x out of range", ag, agbno);
+		w->bad++;
+		return;
+	}
+	uint64_t blkadr = agbno_to_blkadr(ag, agbno);
+	const unsigned char *blk = dev_get(fp, blkadr << g_sb.sb_blocklog, blocksize, buf);
+	if(!blk) { eprintf(WARN, "Failed to read btree block 0x%llx:", blkadr); w->bad++; return; }
+
+	uint32_t m = GET32P(blk);
+	if(m != (g_v5 ? magic3 : magic) || GET16P(&blk[4]) != level) {
+		eprintf(WARN, "AG %llu: bad btree block 0x%llx (magic 0x%x, level %u)", ag, blkadr, m, GET16P(&blk[4]));
+		w->bad++;
+		return;
+	}
+	meta(w, blkadr, 1);
+
+	unsigned numrecs = GET16P(&blk[6]), i;
+	if(level == 0) {
+		unsigned maxrecs = (blocksize - hdr) / recsize;
+		if(numrecs > maxrecs) numrecs = maxrecs;
+		for(i=0; i<numrecs; i++)
+			if(rec) rec(w, ag, &blk[hdr + i*recsize]);
+	} else {
+		unsigned maxrecs = (blocksize - hdr) / (keysize + 4);
+		if(numrecs > maxrecs) numrecs = maxrecs;
+		uint32_t ptrs[numrecs];
+		for(i=0; i<numrecs; i++)
+			ptrs[i] = GET32P(&blk[hdr + maxrecs*keysize + i*4]);
+		for(i=0; i<numrecs; i++)
+			walk_sbtree(fp, w, ag, ptrs[i], level-1, magic, magic3, recsize, keysize, rec);
+	}
+}
+
+static void free_rec(agwalk_t *w, uint64_t ag, const unsigned char *r)
+{
+	if(w->free) w->free(agbno_to_blkadr(ag, GET32P(r)), GET32P(&r[4]));
+}
+
+/* A chunk of 64 inodes; free ones (and sparse holes) have their bit set */
+static void ino_rec(agwalk_t *w, uint64_t ag, const unsigned char *r)
+{
+	uint32_t agino = GET32P(r);
+	uint64_t free = GET64P(&r[8]);
+	uint64_t base = (ag*GET32(g_sb.sb_agblocks) << g_sb.sb_inopblog) + agino;
+	unsigned nblocks = 64 >> g_sb.sb_inopblog, i;
+
+	meta(w, agbno_to_blkadr(ag, agino >> g_sb.sb_inopblog), nblocks ? nblocks : 1);
+	for(i=0; i<64; i++)
+		if(!(free >> i & 1)) w->inode(base + i);
+}
+
+void agwalk(FILE *fp, uint64_t ag, agwalk_t *w)
+{
+	uint32_t sectsize = GET16(g_sb.sb_sectsize), blocksize = GET32(g_sb.sb_blocksize);
+	uint64_t agstart = agbno_to_blkadr(ag, 0);
+	unsigned char agf[sectsize], agi[sectsize], agfl[sectsize];
+
+	meta(w, agstart, (4*sectsize + blocksize - 1) / blocksize);
+
+	if(dev_read(fp, agf, sectsize, (agstart << g_sb.sb_blocklog) + sectsize) < 0 || GET32P(agf) != 0x58414746) {
+		eprintf(WARN, "AG %llu: no AGF, free space unknown", ag);
+		w->bad++;
+	} else {
+		walk_sbtree(fp, w, ag, GET32P(&agf[0x10]), GET32P(&agf[0x1c]) - 1, 0x41425442, 0x41423342, 8, 8, free_rec);
+		walk_sbtree(fp, w, ag, GET32P(&agf[0x14]), GET32P(&agf[0x20]) - 1, 0x41425443, 0x41423343, 8, 8, NULL);
+
+		/* The free list holds blocks for btree splits */
+		unsigned hdr = g_v5 ? AGFL_V5_HDR : 0, size = (sectsize - hdr) / 4;
+		uint32_t i, first = GET32P(&agf[0x28]), count = GET32P(&agf[0x30]);
+		if(count <= size && first < size &&
+				dev_read(fp, agfl, sectsize, (agstart << g_sb.sb_blocklog) + 3*sectsize) == 0)
+			for(i=0; i<count; i++)
+				meta(w, agbno_to_blkadr(ag, GET32P(&agfl[hdr + (first + i) % size * 4])), 1);
+	}
+
+	if(!w->inode) return;
+	if(dev_read(fp, agi, sectsize, (agstart << g_sb.sb_blocklog) + 2*sectsize) < 0 || GET32P(agi) != 0x58414749) {
+		eprintf(WARN, "AG %llu: no AGI, its inodes are missed (try -c censusmap)", ag);
+		w->bad++;
+		return;
+	}
+	walk_sbtree(fp, w, ag, GET32P(&agi[0x14]), GET32P(&agi[0x18]) - 1, 0x49414254, 0x49414233, 16, 4, ino_rec);
+	if(g_v5 && GET32P(&agi[0x148])) /* finobt */
+		walk_sbtree(fp, w, ag, GET32P(&agi[0x148]), GET32P(&agi[0x14c]) - 1, 0x46494254, 0x46494233, 16, 4, NULL);
+}
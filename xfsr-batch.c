@@ -0,0 +1,450 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Batch runner. A queue of jobs, each a device and a recovery plan (a file
+   of shell commands, run one after the other with $DEV, $OUT, $NAME and
+   $STEP set), is run on a pool of worker slots. A step only starts when a
+   slot is free, when fewer than -d steps are already reading from the same
+   disk, and when the machine has the -m memory to spare; otherwise the next
+   job in the queue gets its turn, so jobs on other disks go ahead. The disk
+   of a job is the whole disk under its device, or under the filesystem its
+   image lives on, unless the queue names one. Every finished step goes to a
+   checkpoint file, and a rerun with it carries on from there. */
+
+#include "xfsr.h"
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/wait.h>
+#include <sys/sysmacros.h>
+
+enum jstate { J_PENDING, J_RUNNING, J_DONE, J_FAILED };
+
+static const char *g_jstates[] = { "pending", "running", "done", "failed" };
+
+struct plan {
+	char *path;
+	char **steps;
+	unsigned n;
+};
+
+struct job {
+	char *name, *dev;
+	struct plan *plan;
+	unsigned src;  /* index into g_srcs */
+	unsigned step; /* steps done */
+	int state, status;
+	pid_t pid;
+	double start, secs;
+};
+
+struct source {
+	char *key;
+	unsigned running;
+};
+
+static const char *g_progname = "xfsr-batch";
+static struct job *g_jobs;
+static unsigned g_njobs;
+static struct plan *g_plans[256];
+static unsigned g_nplans;
+static struct source *g_srcs;
+static unsigned g_nsrcs;
+static unsigned g_slots, g_perdisk = 1, g_running;
+static uint64_t g_memfloor; /* kB of MemAvailable a new step needs */
+static const char *g_outroot = ".";
+static FILE *g_ckpt;
+static volatile sig_atomic_t g_stop;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_signal(int sig)
+{
+	g_stop = 1;
+}
+
+static char *xstrdup(const char *s)
+{
+	char *d = strdup(s);
+	if(!d) { eprintf(ERR, "strdup() failed:"); exit(1); }
+	return d;
+}
+
+/* Plans are read once, however many jobs share them */
+static struct plan *plan_load(const char *path)
+{
+	unsigned i;
+	for(i=0; i<g_nplans; i++)
+		if(!strcmp(g_plans[i]->path, path)) return g_plans[i];
+	if(g_nplans == sizeof(g_plans)/sizeof(g_plans[0])) { eprintf(ERR, "Too many plans"); exit(1); }
+
+	FILE *fp = fopen(path, "r");
+	if(!fp) { eprintf(ERR, "Failed to open plan %s:", path); exit(1); }
+	struct plan *p = calloc(1, sizeof(*p));
+	if(!p) { eprintf(ERR, "calloc() failed:"); exit(1); }
+	p->path = xstrdup(path);
+
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while((len = getline(&line, &cap, fp)) > 0) {
+		if(line[len-1] == '\n') line[--len] = '\0';
+		char *s = line + strspn(line, " \t");
+		if(!*s || *s == '#') continue;
+		char **steps = realloc(p->steps, (p->n+1)*sizeof(char *));
+		if(!steps) { eprintf(ERR, "realloc() failed:"); exit(1); }
+		p->steps = steps;
+		p->steps[p->n++] = xstrdup(s);
+	}
+	free(line);
+	fclose(fp);
+	if(!p->n) eprintf(WARN, "Plan %s has no steps", path);
+	return g_plans[g_nplans++] = p;
+}
+
+/* The whole disk behind a device number, as its sysfs node: partitions are
+   folded into their disk, so two images on one spindle share a key. Stacked
+   devices (md, dm) hide their spindles; the queue can name the disk. */
+static char *disk_key(const char *devfile)
+{
+	char first[PATH_MAX], sys[64], real[PATH_MAX], part[PATH_MAX + 16];
+	struct stat st;
+	size_t n = strcspn(devfile, ",");
+
+	snprintf(first, sizeof(first), "%.*s", (int)n, devfile);
+	if(stat(first, &st) < 0) {
+		eprintf(WARN, "Can't stat %s:", first);
+		return xstrdup(first);
+	}
+	dev_t d = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u", major(d), minor(d));
+	if(!realpath(sys, real)) {
+		snprintf(real, sizeof(real), "dev %u:%u", major(d), minor(d));
+		return xstrdup(real);
+	}
+	snprintf(part, sizeof(part), "%s/partition", real);
+	if(access(part, F_OK) == 0) return xstrdup(dirname(real));
+	return xstrdup(real);
+}
+
+static unsigned source_get(const char *key)
+{
+	unsigned i;
+	for(i=0; i<g_nsrcs; i++)
+		if(!strcmp(g_srcs[i].key, key)) return i;
+	struct source *s = realloc(g_srcs, (g_nsrcs+1)*sizeof(*s));
+	if(!s) { eprintf(ERR, "realloc() failed:"); exit(1); }
+	g_srcs = s;
+	g_srcs[g_nsrcs].key = xstrdup(key);
+	g_srcs[g_nsrcs].running = 0;
+	return g_nsrcs++;
+}
+
+static struct job *job_get(const char *name)
+{
+	unsigned i;
+	for(i=0; i<g_njobs; i++)
+		if(!strcmp(g_jobs[i].name, name)) return &g_jobs[i];
+	return NULL;
+}
+
+/* "name<TAB>devfile<TAB>planfile[<TAB>disk]" lines */
+static void queue_load(const char *path)
+{
+	FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if(!fp) { eprintf(ERR, "Failed to open %s:", path); exit(1); }
+
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	unsigned lineno = 0;
+	while((len = getline(&line, &cap, fp)) > 0) {
+		lineno++;
+		if(line[len-1] == '\n') line[--len] = '\0';
+		if(!*line || *line == '#') continue;
+
+		char *save, *name = strtok_r(line, "\t", &save), *dev = strtok_r(NULL, "\t", &save);
+		char *plan = strtok_r(NULL, "\t", &save), *disk = strtok_r(NULL, "\t", &save);
+		if(!plan) { eprintf(WARN, "%s:%u: expected name, devfile and plan", path, lineno); continue; }
+		if(job_get(name)) { eprintf(WARN, "%s:%u: job %s is queued already", path, lineno, name); continue; }
+
+		struct job *j = realloc(g_jobs, (g_njobs+1)*sizeof(*j));
+		if(!j) { eprintf(ERR, "realloc() failed:"); exit(1); }
+		g_jobs = j;
+		j = &g_jobs[g_njobs++];
+		memset(j, 0, sizeof(*j));
+		j->name = xstrdup(name);
+		j->dev = xstrdup(dev);
+		j->plan = plan_load(plan);
+		char *key = disk ? xstrdup(disk) : disk_key(dev);
+		j->src = source_get(key);
+		free(key);
+		if(!j->plan->n) j->state = J_DONE;
+	}
+	free(line);
+	if(fp != stdin) fclose(fp);
+}
+
+/* "name<TAB>step<TAB>status" for every finished step. Read back, the last
+   record of a job says where it stands; failed jobs are only run again with
+   retry set. */
+static int ckpt_open(const char *path, int retry)
+{
+	FILE *fp = fopen(path, "r");
+	if(fp) {
+		char *line = NULL;
+		size_t cap = 0;
+		ssize_t len;
+		unsigned n = 0, i;
+		while((len = getline(&line, &cap, fp)) > 0) {
+			if(line[len-1] != '\n') break; /* cut short by a crash */
+			line[len-1] = '\0';
+			char *tab = strchr(line, '\t');
+			unsigned step;
+			int status;
+			if(!tab || sscanf(tab+1, "%u\t%d", &step, &status) != 2) continue;
+			*tab = '\0';
+			struct job *j = job_get(line);
+			if(!j || !step || step > j->plan->n) continue;
+			j->step = status ? step-1 : step;
+			j->status = status;
+			n++;
+		}
+		free(line);
+		fclose(fp);
+		for(i=0; i<g_njobs; i++) {
+			struct job *j = &g_jobs[i];
+			if(j->step == j->plan->n) j->state = J_DONE;
+			else if(j->status && !retry) j->state = J_FAILED;
+		}
+		eprintf(INFO, "Checkpoint %s: %u records", path, n);
+	}
+
+	if(!(g_ckpt = fopen(path, "a"))) { eprintf(ERR, "Can't open checkpoint %s:", path); return -1; }
+	return 0;
+}
+
+static void ckpt_add(const struct job *j, int status)
+{
+	if(!g_ckpt) return;
+	fprintf(g_ckpt, "%s\t%u\t%d\n", j->name, j->step+1, status);
+	fflush(g_ckpt);
+	fsync(fileno(g_ckpt));
+}
+
+/* MemAvailable in kB, or UINT64_MAX when the kernel doesn't say */
+static uint64_t mem_available(void)
+{
+	FILE *fp = fopen("/proc/meminfo", "r");
+	char line[256];
+	unsigned long long kb;
+	uint64_t avail = UINT64_MAX;
+	if(!fp) return avail;
+	while(fgets(line, sizeof(line), fp))
+		if(sscanf(line, "MemAvailable: %llu kB", &kb) == 1) { avail = kb; break; }
+	fclose(fp);
+	return avail;
+}
+
+static int step_start(struct job *j)
+{
+	char out[PATH_MAX], log[PATH_MAX + 32], step[16];
+	snprintf(out, sizeof(out), "%s/%s", g_outroot, j->name);
+	snprintf(log, sizeof(log), "%s/step%u.log", out, j->step+1);
+	snprintf(step, sizeof(step), "%u", j->step+1);
+	if(mkdir(out, 0755) < 0 && errno != EEXIST) { eprintf(ERR, "Failed to create %s:", out); return -1; }
+
+	pid_t pid = fork();
+	if(pid < 0) { eprintf(ERR, "fork() failed:"); return -1; }
+	if(!pid) {
+		/* Out of the terminal's process group: Ctrl-C stops the batch, not the steps */
+		setpgid(0, 0);
+		int fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644), null = open("/dev/null", O_RDONLY);
+		if(fd < 0 || null < 0) _exit(126);
+		dup2(null, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		setenv("DEV", j->dev, 1);
+		setenv("OUT", out, 1);
+		setenv("NAME", j->name, 1);
+		setenv("STEP", step, 1);
+		execl("/bin/sh", "sh", "-c", j->plan->steps[j->step], (char *)NULL);
+		_exit(127);
+	}
+
+	j->pid = pid;
+	j->state = J_RUNNING;
+	j->start = now();
+	g_srcs[j->src].running++;
+	g_running++;
+	eprintf(INFO, "%s: step %u/%u started on %s", j->name, j->step+1, j->plan->n, g_srcs[j->src].key);
+	return 0;
+}
+
+/* Starts what the limits allow, in queue order. Short of memory, steps
+   wait for running ones to finish; with none running, one goes anyway. */
+static void start_ready(void)
+{
+	unsigned i;
+	for(i=0; i<g_njobs && g_running < g_slots; i++) {
+		struct job *j = &g_jobs[i];
+		if(j->state != J_PENDING || g_srcs[j->src].running >= g_perdisk) continue;
+		if(g_memfloor && g_running && mem_available() < g_memfloor) return;
+		if(step_start(j) < 0) {
+			j->state = J_FAILED;
+			j->status = -1;
+		}
+	}
+}
+
+static void step_done(pid_t pid, int wstatus)
+{
+	unsigned i;
+	for(i=0; i<g_njobs && g_jobs[i].pid != pid; i++);
+	if(i == g_njobs) return;
+
+	struct job *j = &g_jobs[i];
+	int status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+	double secs = now() - j->start;
+	j->secs += secs;
+	j->pid = 0;
+	j->status = status;
+	g_srcs[j->src].running--;
+	g_running--;
+
+	/* Killed during a stop (the signal got to it before setpgid(), or was
+	   sent to it too): not a failure, and left out of the checkpoint so a
+	   rerun does the step again */
+	if(g_stop && WIFSIGNALED(wstatus)) {
+		eprintf(WARN, "%s: step %u was interrupted", j->name, j->step+1);
+		j->state = J_PENDING;
+		return;
+	}
+	ckpt_add(j, status);
+
+	if(status) {
+		eprintf(WARN, "%s: step %u failed with status %d after %.1f seconds, see %s/%s/step%u.log",
+			j->name, j->step+1, status, secs, g_outroot, j->name, j->step+1);
+		j->state = J_FAILED;
+		return;
+	}
+	eprintf(INFO, "%s: step %u done in %.1f seconds", j->name, j->step+1, secs);
+	j->state = ++j->step == j->plan->n ? J_DONE : J_PENDING;
+}
+
+void usage()
+{
+	printf("Run recovery plans for many devices on a shared pool of workers\n");
+	printf("usage: %s [-v -L logfile -j slots -d perdisk -m MB -o outdir -c checkpoint -R] queuefile\n", g_progname);
+	printf("queuefile has \"name<TAB>devfile<TAB>planfile[<TAB>disk]\" lines (\"-\" reads stdin). A plan\n");
+	printf("holds one shell command per line, run in order with $DEV, $OUT (outdir/name), $NAME\n");
+	printf("and $STEP set; the output of each goes to $OUT/stepN.log.\n");
+	printf("-j is the number of steps run at once (default: the CPUs), -d the number per disk\n");
+	printf("(default 1), -m the MB of available memory a step needs to start. -c records\n");
+	printf("finished steps and resumes from them; -R retries the jobs that failed.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c, retry = 0;
+	char *ckptfile = NULL;
+	unsigned i;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	g_slots = ncpu > 0 ? ncpu : 1;
+	while( (c=getopt(argc,argv,"vL:j:d:m:o:c:R")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 'j':
+			g_slots = atoi(optarg);
+			break;
+		case 'd':
+			g_perdisk = atoi(optarg);
+			break;
+		case 'm':
+			g_memfloor = strtoull(optarg,0,0) << 10;
+			break;
+		case 'o':
+			g_outroot = optarg;
+			break;
+		case 'c':
+			ckptfile = optarg;
+			break;
+		case 'R':
+			retry = 1;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind>=argc || g_slots < 1 || g_perdisk < 1) {
+		usage();
+		exit(0);
+	}
+
+	queue_load(argv[optind]);
+	if(ckptfile && ckpt_open(ckptfile, retry) < 0) exit(1);
+	if(mkdir(g_outroot, 0755) < 0 && errno != EEXIST) { eprintf(ERR, "Failed to create %s:", g_outroot); exit(1); }
+	eprintf(INFO, "%u jobs on %u disks, %u slots, %u per disk", g_njobs, g_nsrcs, g_slots, g_perdisk);
+
+	/* On a signal, no new steps are started; the running ones are waited for */
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for(;;) {
+		if(!g_stop) start_ready();
+		if(!g_running) break;
+		int wstatus;
+		pid_t pid = waitpid(-1, &wstatus, 0);
+		if(pid > 0) step_done(pid, wstatus);
+		else if(errno != EINTR) { eprintf(ERR, "waitpid() failed:"); exit(1); }
+	}
+
+	int failed = 0;
+	for(i=0; i<g_njobs; i++) {
+		struct job *j = &g_jobs[i];
+		printf("%s\t%s\t%u/%u\t%.1f\n", j->name, g_jstates[j->state], j->step, j->plan->n, j->secs);
+		failed |= j->state == J_FAILED;
+	}
+	if(g_ckpt) fclose(g_ckpt);
+	return failed;
+}
@@ -0,0 +1,316 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Compressed block bitmaps, roaring style: the device is cut into chunks of
+   64K blocks. A chunk with few bits set keeps them as a sorted array of
+   16 bit offsets and switches to a plain 8KB bitmap once that would be
+   smaller. Empty chunks cost nothing but their slot in the chunk table.
+
+   File layout (host byte order): header, then for every non-empty chunk
+   its index, cardinality and kind, followed by the array or the bitmap. */
+
+#include "xfsr.h"
+#include <string.h>
+
+#define BM_MAGIC "XFSRBMP1"
+#define BM_CHUNK_BITS 16
+#define BM_CHUNK (1u<<BM_CHUNK_BITS)
+#define BM_WORDS (BM_CHUNK/64)
+#define BM_ARRAY_MAX 4096 /* 4096 16 bit entries are as big as the bitmap */
+
+struct bm_chunk {
+	uint32_t card, cap; /* cap is the array's; 0 once it is a bitmap */
+	uint16_t *arr;
+	uint64_t *bits;
+};
+
+struct bm_hdr {
+	char magic[8];
+	uint32_t blocksize, pad;
+	uint64_t nblocks, nchunks;
+};
+
+int bitmap_init(bitmap_t *bm, uint64_t nblocks, uint32_t blocksize)
+{
+	memset(bm, 0, sizeof(*bm));
+	bm->nblocks = nblocks;
+	bm->blocksize = blocksize;
+	bm->nchunks = (nblocks + BM_CHUNK - 1) >> BM_CHUNK_BITS;
+	bm->chunks = calloc(bm->nchunks ? bm->nchunks : 1, sizeof(struct bm_chunk));
+	if(!bm->chunks) { eprintf(ERR, "calloc() failed:"); return -1; }
+	return 0;
+}
+
+void bitmap_free(bitmap_t *bm)
+{
+	size_t i;
+	for(i=0; bm->chunks && i<bm->nchunks; i++) {
+		free(bm->chunks[i].arr);
+		free(bm->chunks[i].bits);
+	}
+	free(bm->chunks);
+	memset(bm, 0, sizeof(*bm));
+}
+
+static int chunk_to_bits(struct bm_chunk *c)
+{
+	uint64_t *bits = calloc(BM_WORDS, sizeof(uint64_t));
+	if(!bits) { eprintf(ERR, "calloc() failed:"); return -1; }
+	uint32_t i;
+	for(i=0; i<c->card; i++)
+		bits[c->arr[i] >> 6] |= 1ULL << (c->arr[i] & 63);
+	free(c->arr);
+	c->arr = NULL;
+	c->cap = 0;
+	c->bits = bits;
+	return 0;
+}
+
+/* First index in the array with arr[i] >= v */
+static uint32_t lower_bound(const struct bm_chunk *c, uint32_t v)
+{
+	uint32_t lo = 0, hi = c->card;
+	while(lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if(c->arr[mid] < v) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static uint64_t range_mask(unsigned lo, unsigned hi) /* bits [lo, hi) of a word, hi <= 64 */
+{
+	return (hi == 64 ? ~0ULL : (1ULL << hi) - 1) & ~((1ULL << lo) - 1);
+}
+
+/* Sets [lo, hi) of chunk k; what was already set goes to dup as well. */
+static int chunk_set_range(bitmap_t *bm, size_t k, uint32_t lo, uint32_t hi, bitmap_t *dup)
+{
+	struct bm_chunk *c = &bm->chunks[k];
+	uint64_t base = (uint64_t)k << BM_CHUNK_BITS;
+
+	if(!c->bits && c->card + (hi - lo) > BM_ARRAY_MAX && chunk_to_bits(c) < 0)
+		return -1;
+
+	if(c->bits) {
+		uint32_t w;
+		for(w=lo>>6; w<=(hi-1)>>6; w++) {
+			unsigned a = w == lo>>6 ? lo & 63 : 0, b = w == (hi-1)>>6 ? ((hi-1) & 63) + 1 : 64;
+			uint64_t m = range_mask(a, b), old = c->bits[w] & m;
+			while(dup && old) {
+				unsigned bit = __builtin_ctzll(old);
+				if(bitmap_set_range(dup, base + w*64 + bit, 1, NULL) < 0) return -1;
+				old &= old - 1;
+			}
+			c->card += __builtin_popcountll(m & ~c->bits[w]);
+			c->bits[w] |= m;
+		}
+		return 0;
+	}
+
+	/* Merge the sorted array with the range */
+	uint32_t n = c->card + (hi - lo), i = 0, j = 0, v = lo;
+	if(n > c->cap) {
+		uint32_t cap = c->cap ? c->cap : 16;
+		while(cap < n) cap *= 2;
+		if(cap > BM_ARRAY_MAX) cap = BM_ARRAY_MAX;
+		uint16_t *p = realloc(c->arr, cap*sizeof(uint16_t));
+		if(!p) { eprintf(ERR, "realloc() failed:"); return -1; }
+		c->arr = p;
+		c->cap = cap;
+	}
+	uint16_t tmp[BM_ARRAY_MAX];
+	uint32_t start = lower_bound(c, lo);
+	memcpy(tmp, c->arr, start*sizeof(uint16_t));
+	j = start;
+	for(i=start; i<c->card || v<hi; ) {
+		if(v < hi && (i == c->card || v < c->arr[i])) {
+			tmp[j++] = v++;
+		} else if(v < hi && v == c->arr[i]) {
+			if(dup && bitmap_set_range(dup, base + v, 1, NULL) < 0) return -1;
+			tmp[j++] = v++;
+			i++;
+		} else {
+			tmp[j++] = c->arr[i++];
+		}
+	}
+	memcpy(c->arr, tmp, j*sizeof(uint16_t));
+	c->card = j;
+	return 0;
+}
+
+/* Sets blocks [start, start+len), clipped to the device. Blocks that were
+   already set are also set in dup, unless it is NULL. */
+int bitmap_set_range(bitmap_t *bm, uint64_t start, uint64_t len, bitmap_t *dup)
+{
+	if(start >= bm->nblocks) return 0;
+	if(len > bm->nblocks - start) len = bm->nblocks - start;
+	uint64_t end = start + len;
+	while(start < end) {
+		size_t k = start >> BM_CHUNK_BITS;
+		uint64_t cend = ((uint64_t)k + 1) << BM_CHUNK_BITS;
+		if(cend > end) cend = end;
+		if(chunk_set_range(bm, k, start & (BM_CHUNK-1), ((cend - 1) & (BM_CHUNK-1)) + 1, dup) < 0)
+			return -1;
+		start = cend;
+	}
+	return 0;
+}
+
+int bitmap_test(const bitmap_t *bm, uint64_t b)
+{
+	if(b >= bm->nblocks) return 0;
+	const struct bm_chunk *c = &bm->chunks[b >> BM_CHUNK_BITS];
+	uint32_t lo = b & (BM_CHUNK-1);
+	if(c->bits) return (c->bits[lo >> 6] >> (lo & 63)) & 1;
+	uint32_t i = lower_bound(c, lo);
+	return i < c->card && c->arr[i] == lo;
+}
+
+/* First block >= from whose bit is set (or clear, if set is 0); nblocks if
+   there is none. */
+uint64_t bitmap_next(const bitmap_t *bm, uint64_t from, int set)
+{
+	while(from < bm->nblocks) {
+		size_t k = from >> BM_CHUNK_BITS;
+		const struct bm_chunk *c = &bm->chunks[k];
+		uint64_t base = (uint64_t)k << BM_CHUNK_BITS;
+		uint32_t lo = from & (BM_CHUNK-1);
+
+		if(c->card == (set ? 0 : BM_CHUNK)) {
+			from = base + BM_CHUNK;
+			continue;
+		}
+		if(c->card == (set ? BM_CHUNK : 0))
+			return from;
+
+		if(c->bits) {
+			uint32_t w = lo >> 6;
+			uint64_t word = (set ? c->bits[w] : ~c->bits[w]) & range_mask(lo & 63, 64);
+			while(!word && ++w < BM_WORDS)
+				word = set ? c->bits[w] : ~c->bits[w];
+			if(word) {
+				uint64_t b = base + w*64 + __builtin_ctzll(word);
+				return b < bm->nblocks ? b : bm->nblocks;
+			}
+		} else {
+			uint32_t i = lower_bound(c, lo);
+			if(set) {
+				if(i < c->card) return base + c->arr[i];
+			} else {
+				uint32_t v = lo;
+				for(; i < c->card && c->arr[i] == v; i++) v++;
+				if(v < BM_CHUNK) return base + v < bm->nblocks ? base + v : bm->nblocks;
+			}
+		}
+		from = base + BM_CHUNK;
+	}
+	return bm->nblocks;
+}
+
+uint64_t bitmap_count(const bitmap_t *bm)
+{
+	uint64_t n = 0;
+	size_t i;
+	for(i=0; i<bm->nchunks; i++) n += bm->chunks[i].card;
+	return n;
+}
+
+/* Set blocks in [start, start+len) */
+uint64_t bitmap_count_range(const bitmap_t *bm, uint64_t start, uint64_t len)
+{
+	uint64_t end = start + len < bm->nblocks ? start + len : bm->nblocks, n = 0;
+	while(start < end) {
+		uint64_t s = bitmap_next(bm, start, 1);
+		if(s >= end) break;
+		uint64_t e = bitmap_next(bm, s, 0);
+		if(e > end) e = end;
+		n += e - s;
+		start = e;
+	}
+	return n;
+}
+
+int bitmap_save(const bitmap_t *bm, const char *path)
+{
+	FILE *fp = fopen(path, "w");
+	if(!fp) { eprintf(ERR, "Failed to open %s:", path); return -1; }
+
+	struct bm_hdr h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BM_MAGIC, 8);
+	h.blocksize = bm->blocksize;
+	h.nblocks = bm->nblocks;
+	size_t i;
+	for(i=0; i<bm->nchunks; i++) h.nchunks += bm->chunks[i].card != 0;
+	fwrite(&h, sizeof(h), 1, fp);
+
+	for(i=0; i<bm->nchunks; i++) {
+		const struct bm_chunk *c = &bm->chunks[i];
+		if(!c->card) continue;
+		uint32_t rec[3] = { i, c->card, c->bits != NULL };
+		fwrite(rec, sizeof(rec), 1, fp);
+		if(c->bits) fwrite(c->bits, sizeof(uint64_t), BM_WORDS, fp);
+		else fwrite(c->arr, sizeof(uint16_t), c->card, fp);
+	}
+	if(fclose(fp) != 0) { eprintf(ERR, "Failed to write %s:", path); return -1; }
+	return 0;
+}
+
+int bitmap_load(bitmap_t *bm, const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if(!fp) { eprintf(ERR, "Failed to open %s:", path); return -1; }
+
+	struct bm_hdr h;
+	if(fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, BM_MAGIC, 8)) {
+		eprintf(ERR, "%s is not an xfsr bitmap", path);
+		fclose(fp);
+		return -1;
+	}
+	if(bitmap_init(bm, h.nblocks, h.blocksize) < 0) { fclose(fp); return -1; }
+
+	uint64_t k;
+	for(k=0; k<h.nchunks; k++) {
+		uint32_t rec[3];
+		if(fread(rec, sizeof(rec), 1, fp) != 1 || rec[0] >= bm->nchunks || !rec[1] || rec[1] > BM_CHUNK ||
+				(!rec[2] && rec[1] > BM_ARRAY_MAX))
+			goto bad;
+		struct bm_chunk *c = &bm->chunks[rec[0]];
+		c->card = rec[1];
+		if(rec[2]) {
+			c->bits = malloc(BM_WORDS*sizeof(uint64_t));
+			if(!c->bits || fread(c->bits, sizeof(uint64_t), BM_WORDS, fp) != BM_WORDS) goto bad;
+		} else {
+			c->arr = malloc(c->card*sizeof(uint16_t));
+			c->cap = c->card;
+			if(!c->arr || fread(c->arr, sizeof(uint16_t), c->card, fp) != c->card) goto bad;
+		}
+	}
+	fclose(fp);
+	return 0;
+
+bad:
+	eprintf(ERR, "%s is truncated or corrupt", path);
+	fclose(fp);
+	bitmap_free(bm);
+	return -1;
+}
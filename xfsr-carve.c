@@ -0,0 +1,532 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* File carving: one sequential pass over the device, testing signatures
+   only at block starts. A carved file is assumed to be contiguous; it ends
+   at its footer, at the length its header announces, at maxsize, at a zero
+   block, or when another header shows up. */
+
+#define _GNU_SOURCE
+#include "xfsr.h"
+#include <string.h>
+#include <getopt.h>
+
+#define CARVE_CHUNK (4<<20)
+
+#define F_FOOTER_LAST 1 /* keep going, cut at the last footer seen */
+#define F_ZERO_ENDS 2 /* a zero block ends the file */
+#define F_CONTAINER 4 /* holds whole files; their headers don't end it */
+#define F_FOOTER_COMMENT 8 /* the footer ends in a 16 bit LE comment length */
+
+struct carve;
+
+struct sig {
+	const char *ext;
+	const char *magic;
+	unsigned magiclen, magicoff;
+	const char *footer;
+	unsigned footerlen, footerextra;
+	uint64_t maxsize;
+	int flags;
+	/* Total length from the first block, 0 if unknown */
+	uint64_t (*length)(const unsigned char *hdr, size_t len);
+	/* Called on every block; returns nonzero once the end is known */
+	int (*step)(struct carve *c, const unsigned char *blk, size_t len);
+};
+
+struct carve {
+	const struct sig *sig;
+	FILE *out;
+	uint64_t blkadr;
+	uint64_t len; /* bytes written */
+	uint64_t want; /* known length, 0 if unknown */
+	uint64_t cut; /* end of last footer, 0 if none */
+	uint64_t next; /* tar: offset of next header */
+	unsigned zeros; /* tar: consecutive zero records */
+	unsigned char jstate, jcode; /* jpg: parser state, current marker */
+	unsigned jskip; /* jpg: segment bytes left to skip */
+	int jscan; /* jpg: a scan has started */
+	unsigned char tail[16]; /* last bytes written, for footers across blocks */
+};
+
+static uint64_t sqlite_length(const unsigned char *hdr, size_t len)
+{
+	uint32_t pagesize = (hdr[16]<<8) | hdr[17];
+	if(pagesize == 1) pagesize = 65536;
+	return (uint64_t)pagesize * GET32P(&hdr[28]);
+}
+
+static uint64_t tar_octal(const unsigned char *p, unsigned n)
+{
+	uint64_t v = 0;
+	for(; n && *p == ' '; n--, p++);
+	for(; n && *p >= '0' && *p <= '7'; n--, p++)
+		v = v*8 + (*p - '0');
+	return v;
+}
+
+/* Walks the tar headers as their records stream by; the archive ends with
+   two zero records. */
+static int tar_step(struct carve *c, const unsigned char *blk, size_t len)
+{
+	uint64_t base = c->len;
+	while(c->next >= base && c->next + 512 <= base + len) {
+		const unsigned char *rec = blk + (c->next - base);
+		unsigned i;
+		for(i=0; i<512 && !rec[i]; i++);
+		if(i == 512) {
+			c->next += 512;
+			if(++c->zeros == 2) { c->want = c->next; return 1; }
+			continue;
+		}
+		if(memcmp(&rec[257], "ustar", 5)) { c->want = c->next; return 1; }
+		c->zeros = 0;
+		c->next += 512 + ((tar_octal(&rec[124], 12) + 511) & ~511ULL);
+	}
+	return 0;
+}
+
+enum { JPG_MARK, JPG_CODE, JPG_LEN1, JPG_LEN2, JPG_SKIP, JPG_SCAN, JPG_SCANFF };
+
+/* Walks the JPEG marker segments, skipping their payloads by the length
+   fields, so the FF D9 of an EXIF thumbnail inside APP1 doesn't end the
+   file. Only an EOI at marker level, once a scan has started, does; a new
+   SOI or anything that isn't a marker where one is due ends it before. */
+static int jpg_step(struct carve *c, const unsigned char *blk, size_t len)
+{
+	size_t i = 0;
+	while(i < len) {
+		unsigned b = blk[i];
+		switch(c->jstate) {
+		case JPG_MARK:
+			if(b != 0xff) { c->want = c->len + i; return 1; }
+			c->jstate = JPG_CODE;
+			break;
+		case JPG_SCANFF:
+			/* Stuffed zero or restart marker: still scan data */
+			if(b == 0x00 || (b >= 0xd0 && b <= 0xd7)) { c->jstate = JPG_SCAN; break; }
+			/* Any other marker ends the scan */
+			/* fall through */
+		case JPG_CODE:
+			if(b == 0xff) break; /* fill */
+			if(b == 0xd9 && c->jscan) { c->want = c->len + i + 1; return 1; }
+			if(b == 0xd8 && c->len + i > 1) { c->want = c->len + i - 1; return 1; }
+			if(b == 0xd8 || b == 0xd9 || b == 0x01 || (b >= 0xd0 && b <= 0xd7)) {
+				c->jstate = JPG_MARK; /* no payload */
+				break;
+			}
+			c->jcode = b;
+			c->jstate = JPG_LEN1;
+			break;
+		case JPG_LEN1:
+			c->jskip = b << 8;
+			c->jstate = JPG_LEN2;
+			break;
+		case JPG_LEN2:
+			c->jskip |= b;
+			if(c->jskip < 2) { c->want = c->len + i + 1; return 1; }
+			c->jskip -= 2; /* the length counts itself */
+			c->jstate = JPG_SKIP;
+			break;
+		case JPG_SKIP:
+		{
+			size_t n = len - i < c->jskip ? len - i : c->jskip;
+			c->jskip -= n;
+			i += n;
+			if(!c->jskip) {
+				if(c->jcode == 0xda) c->jscan = 1; /* SOS: entropy-coded data follows */
+				c->jstate = c->jcode == 0xda ? JPG_SCAN : JPG_MARK;
+			}
+			continue;
+		}
+		case JPG_SCAN:
+		{
+			const unsigned char *p = memchr(blk + i, 0xff, len - i);
+			if(!p) return 0;
+			i = p - blk;
+			c->jstate = JPG_SCANFF;
+			break;
+		}
+		}
+		i++;
+	}
+	return 0;
+}
+
+static const struct sig g_sigs[] = {
+	{ "jpg", "\xff\xd8\xff", 3, 0, NULL, 0, 0, 32<<20, 0, NULL, jpg_step },
+	{ "png", "\x89PNG\r\n\x1a\n", 8, 0, "IEND\xae\x42\x60\x82", 8, 0, 64<<20, 0, NULL, NULL },
+	{ "pdf", "%PDF-", 5, 0, "%%EOF", 5, 0, 256<<20, F_FOOTER_LAST | F_ZERO_ENDS, NULL, NULL },
+	{ "zip", "PK\x03\x04", 4, 0, "PK\x05\x06", 4, 18, 1ULL<<30, F_FOOTER_LAST | F_ZERO_ENDS | F_FOOTER_COMMENT, NULL, NULL },
+	{ "sqlite", "SQLite format 3", 16, 0, NULL, 0, 0, 4ULL<<30, F_ZERO_ENDS, sqlite_length, NULL },
+	{ "gz", "\x1f\x8b\x08", 3, 0, NULL, 0, 0, 64<<20, F_ZERO_ENDS, NULL, NULL },
+	{ "bz2", "BZh", 3, 0, NULL, 0, 0, 64<<20, F_ZERO_ENDS, NULL, NULL },
+	{ "tar", "ustar", 5, 257, NULL, 0, 0, 4ULL<<30, F_CONTAINER, NULL, tar_step },
+};
+#define NSIGS (sizeof(g_sigs)/sizeof(g_sigs[0]))
+
+static const char *g_progname = "xfsr-carve";
+static const char *g_outdir = ".";
+static uint64_t g_maxsize = 0;
+static unsigned g_ncarved[NSIGS];
+
+/* Blocks owned by known inodes, sorted and merged */
+static struct range { uint64_t start, len; } *g_owned;
+static size_t g_nowned, g_ownedcur;
+/* Block masks from xfsr-owners: only blocks in g_include, none in g_exclude */
+static bitmap_t g_include, g_exclude;
+
+static const struct sig *match_sig(const unsigned char *blk, size_t len)
+{
+	unsigned i;
+	for(i=0; i<NSIGS; i++) {
+		const struct sig *s = &g_sigs[i];
+		if(s->magicoff + s->magiclen <= len && !memcmp(blk + s->magicoff, s->magic, s->magiclen))
+			return s;
+	}
+	return NULL;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct range *x = a, *y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int load_owned(FILE *devfp, const char *listfile)
+{
+	uint64_t *iadrs;
+	int n = read_iadr_list(listfile, &iadrs);
+	if(n < 0) return -1;
+
+	extmap_t map;
+	extmap_init(&map);
+	size_t cap = 0;
+	int i;
+	for(i=0; i<n; i++) {
+		xfs_dinode_t dinode;
+		if(read_inode(devfp, &dinode, iadrs[i]) < 0) continue;
+		int fmt = dinode.di_core.di_format;
+		if(fmt != XFS_DINODE_FMT_EXTENTS && fmt != XFS_DINODE_FMT_BTREE) continue;
+		if(extmap_load(devfp, iadrs[i], &dinode, &map) < 0) continue;
+
+		size_t j;
+		for(j=0; j<map.n; j++) {
+			if(g_nowned == cap) {
+				cap = cap ? 2*cap : 4096;
+				struct range *r = realloc(g_owned, cap*sizeof(*r));
+				if(!r) { eprintf(ERR, "realloc() failed:"); exit(1); }
+				g_owned = r;
+			}
+			g_owned[g_nowned].start = blkno_to_blkadr(map.startblock[j]);
+			g_owned[g_nowned].len = map.count[j];
+			g_nowned++;
+		}
+	}
+	extmap_free(&map);
+	free(iadrs);
+
+	qsort(g_owned, g_nowned, sizeof(*g_owned), range_cmp);
+	size_t j, k = 0;
+	for(j=1; j<g_nowned; j++) {
+		if(g_owned[j].start <= g_owned[k].start + g_owned[k].len) {
+			uint64_t end = g_owned[j].start + g_owned[j].len;
+			if(end > g_owned[k].start + g_owned[k].len)
+				g_owned[k].len = end - g_owned[k].start;
+		} else {
+			g_owned[++k] = g_owned[j];
+		}
+	}
+	if(g_nowned) g_nowned = k+1;
+	eprintf(INFO, "%zu owned ranges from %d inodes", g_nowned, n);
+	return 0;
+}
+
+/* Blocks are visited in increasing order, so a cursor is enough. */
+static int owned(uint64_t blkadr)
+{
+	while(g_ownedcur < g_nowned && g_owned[g_ownedcur].start + g_owned[g_ownedcur].len <= blkadr)
+		g_ownedcur++;
+	return g_ownedcur < g_nowned && g_owned[g_ownedcur].start <= blkadr;
+}
+
+static int masked(uint64_t blkadr)
+{
+	return (g_include.chunks && !bitmap_test(&g_include, blkadr)) ||
+		(g_exclude.chunks && bitmap_test(&g_exclude, blkadr));
+}
+
+/* First block at or after blkadr that the masks let through */
+static uint64_t next_unmasked(uint64_t blkadr)
+{
+	uint64_t b;
+	do {
+		b = blkadr;
+		if(g_include.chunks) blkadr = bitmap_next(&g_include, blkadr, 1);
+		if(g_exclude.chunks) blkadr = bitmap_next(&g_exclude, blkadr, 0);
+	} while(b != blkadr);
+	return blkadr;
+}
+
+static int load_mask(bitmap_t *bm, const char *path)
+{
+	if(bitmap_load(bm, path) < 0) return -1;
+	if(bm->blocksize != GET32(g_sb.sb_blocksize)) {
+		eprintf(ERR, "%s was made for %u byte blocks", path, bm->blocksize);
+		return -1;
+	}
+	return 0;
+}
+
+static void carve_finish(struct carve *c)
+{
+	if(!c->sig) return;
+	uint64_t len = c->len;
+	if(c->want && c->want < len) len = c->want;
+	fflush(c->out);
+	if(c->cut) {
+		len = c->cut;
+		/* The comment length is the last field of the footer; it's in the file by now */
+		unsigned char cl[2];
+		if((c->sig->flags & F_FOOTER_COMMENT) && pread(fileno(c->out), cl, 2, c->cut - 2) == 2)
+			len += cl[0] | cl[1] << 8;
+	}
+	/* The footer, or its comment, may run past what was written */
+	if(len > c->len) len = c->len;
+	if(ftruncate(fileno(c->out), len) != 0)
+		eprintf(WARN, "ftruncate() failed:");
+	fclose(c->out);
+	printf("0x%llx\t%s\t%llu\n", (unsigned long long)c->blkadr, c->sig->ext, (unsigned long long)len);
+	fflush(stdout);
+	c->sig = NULL;
+}
+
+static int carve_start(struct carve *c, const struct sig *s, uint64_t blkadr, const unsigned char *blk, size_t len)
+{
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%012llx.%s", g_outdir, (unsigned long long)blkadr, s->ext);
+	memset(c, 0, sizeof(*c));
+	c->out = fopen(path, "w+"); /* carve_finish() reads the footer back */
+	if(!c->out) { eprintf(ERR, "Failed to open %s:", path); return -1; }
+	c->sig = s;
+	c->blkadr = blkadr;
+	if(s->length) c->want = s->length(blk, len);
+	g_ncarved[s - g_sigs]++;
+	return 0;
+}
+
+/* Appends a block; returns nonzero when the file is complete. */
+static int carve_feed(struct carve *c, const unsigned char *blk, size_t len)
+{
+	const struct sig *s = c->sig;
+	uint64_t max = g_maxsize ? g_maxsize : s->maxsize;
+
+	if(s->step && s->step(c, blk, len) && c->want <= c->len)
+		return 1;
+
+	size_t n = len;
+	if(c->want && c->want - c->len < n) n = c->want - c->len;
+	if(max - c->len < n) n = max - c->len;
+
+	if(s->footer) {
+		/* A footer straddling the previous block boundary first */
+		unsigned fl = s->footerlen, keep = c->len < fl-1 ? c->len : fl-1;
+		unsigned char edge[32];
+		memcpy(edge, c->tail + sizeof(c->tail) - keep, keep);
+		memcpy(edge + keep, blk, n < fl-1 ? n : fl-1);
+		unsigned edgelen = keep + (n < fl-1 ? n : fl-1);
+		const unsigned char *hit = memmem(edge, edgelen, s->footer, fl);
+		if(hit) c->cut = c->len - keep + (hit - edge) + fl + s->footerextra;
+
+		const unsigned char *p = blk;
+		while((hit = memmem(p, n - (p - blk), s->footer, fl))) {
+			c->cut = c->len + (hit - blk) + fl + s->footerextra;
+			if(!(s->flags & F_FOOTER_LAST)) break;
+			p = hit + 1;
+		}
+	}
+
+	if(fwrite(blk, 1, n, c->out) != n)
+		eprintf(WARN, "Short write on carved file:");
+	if(n >= sizeof(c->tail)) {
+		memcpy(c->tail, blk + n - sizeof(c->tail), sizeof(c->tail));
+	} else {
+		memmove(c->tail, c->tail + n, sizeof(c->tail) - n);
+		memcpy(c->tail + sizeof(c->tail) - n, blk, n);
+	}
+	c->len += n;
+
+	if(c->cut && !(s->flags & F_FOOTER_LAST)) return 1;
+	if(c->want && c->len >= c->want) return 1;
+	return c->len >= max;
+}
+
+static int zero_block(const unsigned char *blk, size_t len)
+{
+	return blk[0] == 0 && !memcmp(blk, blk+1, len-1);
+}
+
+/* One block of the scan; an unreadable one (blk NULL) ends the current file
+   like an owned one does. */
+static void carve_block(struct carve *cur, uint64_t blkadr, const unsigned char *blk, uint32_t blocksize)
+{
+	if(!blk || owned(blkadr) || masked(blkadr)) {
+		carve_finish(cur);
+		return;
+	}
+
+	const struct sig *s = match_sig(blk, blocksize);
+	/* Tar members start on record boundaries; they don't end the archive.
+	   A step knows best about its own header (a jpg thumbnail, say). */
+	if(cur->sig && s && !cur->want && !(cur->sig->flags & F_CONTAINER) && !(s == cur->sig && s->step))
+		carve_finish(cur);
+	if(cur->sig && !cur->want && (cur->sig->flags & F_ZERO_ENDS) && zero_block(blk, blocksize))
+		carve_finish(cur);
+
+	if(!cur->sig && s && carve_start(cur, s, blkadr, blk, blocksize) < 0)
+		exit(1);
+	if(cur->sig && carve_feed(cur, blk, blocksize))
+		carve_finish(cur);
+}
+
+void usage()
+{
+	printf("Carve files out of blocks by signature, in one pass over the device\n");
+	printf("usage: %s [-v -M -L logfile -x iadrlist -k includemap -X excludemap -s startblk -e endblk -m maxsize] -o outdir devfile\n", g_progname);
+	printf("Blocks of the inodes listed in iadrlist (as printed by xfsr-dirfind) are skipped.\n");
+	printf("With the block maps of xfsr-owners, -k carves only blocks in the map (e.g. the orphans),\n");
+	printf("-X skips blocks in it (e.g. the owned ones).\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *devfile = NULL, *ownedfile = NULL, *includefile = NULL, *excludefile = NULL;
+	uint64_t start = 0, end = 0;
+	setlocale(LC_ALL, "");
+
+	while( (c=getopt(argc,argv,"vML:x:k:X:s:e:m:o:")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 'x':
+			ownedfile = optarg;
+			break;
+		case 'k':
+			includefile = optarg;
+			break;
+		case 'X':
+			excludefile = optarg;
+			break;
+		case 's':
+			start = strtoull(optarg,0,0);
+			break;
+		case 'e':
+			end = strtoull(optarg,0,0);
+			break;
+		case 'm':
+			g_maxsize = strtoull(optarg,0,0);
+			break;
+		case 'o':
+			g_outdir = optarg;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind>=argc) {
+		usage();
+		exit(0);
+	}
+
+	devfile = argv[optind];
+
+	FILE *devfp = dev_open(devfile);
+	if(!devfp) { perror(strerror(errno)); exit(errno); }
+
+	if(read_sb(devfp) <0) {
+		eprintf(ERR, "Not a valid superblock");
+		exit(2);
+	}
+	sb_print();
+
+	if(ownedfile && load_owned(devfp, ownedfile) < 0) exit(1);
+	if(includefile && load_mask(&g_include, includefile) < 0) exit(1);
+	if(excludefile && load_mask(&g_exclude, excludefile) < 0) exit(1);
+	uint64_t nblocks = GET64(g_sb.sb_dblocks);
+
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	unsigned perchunk = CARVE_CHUNK / blocksize;
+	unsigned char *buf = malloc(CARVE_CHUNK);
+	if(!buf) { perror(strerror(errno)); exit(errno); }
+	dev_advise(DEV_SEQUENTIAL);
+
+	struct carve cur;
+	memset(&cur, 0, sizeof(cur));
+	uint64_t blkadr = start, unreadable = 0;
+	if(!end || end > nblocks) end = nblocks;
+
+	while(blkadr < end) {
+		if(g_include.chunks || g_exclude.chunks) {
+			/* Don't read what the masks leave out */
+			uint64_t next = next_unmasked(blkadr);
+			if(next != blkadr) carve_finish(&cur);
+			blkadr = next;
+			if(blkadr >= end) break;
+		}
+		unsigned n = end - blkadr < perchunk ? end - blkadr : perchunk, i;
+		const unsigned char *chunk = dev_get(devfp, blkadr << g_sb.sb_blocklog, (size_t)n*blocksize, buf);
+		if(!chunk && n > 1) {
+			/* Go block by block through the bad spot, then speed up again */
+			uint64_t stop = blkadr + n;
+			for(; blkadr < stop; blkadr++) {
+				const unsigned char *blk = dev_get(devfp, blkadr << g_sb.sb_blocklog, blocksize, buf);
+				unreadable += !blk;
+				carve_block(&cur, blkadr, blk, blocksize);
+			}
+			continue;
+		}
+		for(i=0; i<n; i++, blkadr++) {
+			unreadable += !chunk;
+			carve_block(&cur, blkadr, chunk ? chunk + (size_t)i*blocksize : NULL, blocksize);
+		}
+		if(blkadr % (1<<20) < n)
+			TRACE("carve: current block=0x%llx", blkadr);
+	}
+	carve_finish(&cur);
+	if(unreadable) eprintf(WARN, "%llu blocks could not be read", unreadable);
+
+	unsigned i;
+	for(i=0; i<NSIGS; i++)
+		if(g_ncarved[i]) eprintf(WARN, "%u %s files", g_ncarved[i], g_sigs[i].ext);
+
+	return 0;
+}
@@ -0,0 +1,357 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Block census. One sequential pass classifies every block by the magic in
+   its first bytes and records the result in a map with one byte per block
+   (BT_* type, BT_BAD if the header doesn't check out). Other tools can load
+   the map to go straight to the blocks they want. A partial scan (-s/-e)
+   updates an existing map in place, so a census can be done in pieces.
+
+   Map layout (host byte order): struct census_hdr, then nblocks bytes. */
+
+#include "xfsr.h"
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define CENSUS_MAGIC "XFSRMAP1"
+#define CENSUS_CHUNK (4<<20)
+
+struct census_hdr {
+	char magic[8];
+	uint32_t blocksize, agblocks, agcount, pad;
+	uint64_t nblocks;
+};
+
+static const char *g_names[BT_NTYPES] = {
+	"unscanned", "unreadable", "zero", "data", "sb", "agf", "agi", "agfl",
+	"inobt", "finobt", "bnobt", "cntbt", "rmapbt", "refcbt", "bmap", "inodes",
+	"dir_block", "dir_data", "dir_leaf", "da_node", "dir_free", "attr_leaf", "symlink",
+};
+
+const char *census_name(unsigned type)
+{
+	type &= ~BT_BAD;
+	return type < BT_NTYPES ? g_names[type] : "?";
+}
+
+int census_type(const char *name)
+{
+	unsigned i;
+	for(i=0; i<BT_NTYPES; i++)
+		if(!strcmp(name, g_names[i])) return i;
+	return -1;
+}
+
+/* v5 blocks say where they are; daddr is in 512 byte units */
+static int blkno_ok(const unsigned char *blk, unsigned off, uint64_t blkadr)
+{
+	return GET64P(&blk[off]) == blkadr << (g_sb.sb_blocklog - 9);
+}
+
+/* Short form btree blocks (AG btrees): crc at 0x34, blkno at 0x10 */
+static int sbtree(const unsigned char *blk, size_t len, uint64_t blkadr, int type, int crc)
+{
+	if(GET16P(&blk[4]) >= EXTMAP_MAXLEVELS || GET16P(&blk[6]) > len/4) return type | BT_BAD;
+	if(crc && (!blkno_ok(blk, 0x10, blkadr) || !xfs_cksum_ok(blk, len, 0x34))) return type | BT_BAD;
+	return type;
+}
+
+static int inodes(const unsigned char *blk, size_t len)
+{
+	unsigned inodesize = GET16(g_sb.sb_inodesize);
+	const unsigned char *p;
+	int type = BT_INODES;
+	for(p=blk; p+inodesize <= blk+len; p+=inodesize)
+		if(GET16P(p) != XFS_DINODE_MAGIC || !inode_crc_ok(p)) type |= BT_BAD;
+	return type;
+}
+
+/* Only header bytes are looked at, except to tell zero blocks from data. */
+int census_classify(const unsigned char *blk, size_t len, uint64_t blkadr)
+{
+	uint32_t magic = GET32P(blk);
+	uint16_t damagic = GET16P(&blk[8]);
+	uint64_t ag = blkadr / GET32(g_sb.sb_agblocks);
+
+	switch(magic) {
+	case 0x58465342: /* XFSB; with small sectors the AG headers share its block */
+		if(g_v5 && !xfs_cksum_ok(blk, GET16(g_sb.sb_sectsize), 0xe0)) return BT_SB | BT_BAD;
+		return BT_SB;
+	case 0x58414746: /* XAGF */
+		return GET32P(&blk[8]) == ag ? BT_AGF : BT_AGF | BT_BAD;
+	case 0x58414749: /* XAGI */
+		return GET32P(&blk[8]) == ag ? BT_AGI : BT_AGI | BT_BAD;
+	case 0x5841464c: /* XAFL, v5 only */
+		return GET32P(&blk[4]) == ag ? BT_AGFL : BT_AGFL | BT_BAD;
+	case 0x49414254: return sbtree(blk, len, blkadr, BT_INOBT, 0); /* IABT */
+	case 0x49414233: return sbtree(blk, len, blkadr, BT_INOBT, 1); /* IAB3 */
+	case 0x46494254: return sbtree(blk, len, blkadr, BT_FINOBT, 0); /* FIBT */
+	case 0x46494233: return sbtree(blk, len, blkadr, BT_FINOBT, 1); /* FIB3 */
+	case 0x41425442: return sbtree(blk, len, blkadr, BT_BNOBT, 0); /* ABTB */
+	case 0x41423342: return sbtree(blk, len, blkadr, BT_BNOBT, 1); /* AB3B */
+	case 0x41425443: return sbtree(blk, len, blkadr, BT_CNTBT, 0); /* ABTC */
+	case 0x41423343: return sbtree(blk, len, blkadr, BT_CNTBT, 1); /* AB3C */
+	case 0x524d4233: return sbtree(blk, len, blkadr, BT_RMAPBT, 1); /* RMB3 */
+	case 0x52334643: return sbtree(blk, len, blkadr, BT_REFCBT, 1); /* R3FC */
+	case XFS_BMAP_MAGIC:
+		return GET16P(&blk[4]) < EXTMAP_MAXLEVELS ? BT_BMAP : BT_BMAP | BT_BAD;
+	case XFS_BMAP_CRC_MAGIC: /* long form: blkno at 0x18, crc at 0x40 */
+		return blkno_ok(blk, 0x18, blkadr) && xfs_cksum_ok(blk, len, 0x40) ? BT_BMAP : BT_BMAP | BT_BAD;
+	case XFS_DIR2_BLOCK_MAGIC: return BT_DIR_BLOCK;
+	case XFS_DIR2_DATA_MAGIC: return BT_DIR_DATA;
+	case 0x58443246: return BT_DIR_FREE; /* XD2F */
+	case XFS_DIR3_BLOCK_MAGIC:
+	case XFS_DIR3_DATA_MAGIC:
+	case 0x58444633: /* XDF3 */
+	{
+		int type = magic == XFS_DIR3_BLOCK_MAGIC ? BT_DIR_BLOCK : magic == XFS_DIR3_DATA_MAGIC ? BT_DIR_DATA : BT_DIR_FREE;
+		return blkno_ok(blk, 8, blkadr) && xfs_cksum_ok(blk, len, 4) ? type : type | BT_BAD;
+	}
+	case XFS_SYMLINK_MAGIC: /* v5 remote symlink */
+		return xfs_cksum_ok(blk, len, 12) ? BT_SYMLINK : BT_SYMLINK | BT_BAD;
+	}
+
+	/* Dir/attr btree blocks keep a 16 bit magic after the sibling pointers */
+	switch(damagic) {
+	case 0xd2f1: case 0xd2ff: /* leaf1, leafn */
+		if(!GET16P(&blk[10])) return BT_DIR_LEAF;
+		break;
+	case 0xfebe:
+		if(!GET16P(&blk[10])) return BT_DA_NODE;
+		break;
+	case 0xfbee:
+		if(!GET16P(&blk[10])) return BT_ATTR_LEAF;
+		break;
+	case 0x3df1: case 0x3dff: case 0x3ebe: case 0x3bee:
+	{
+		int type = damagic == 0x3ebe ? BT_DA_NODE : damagic == 0x3bee ? BT_ATTR_LEAF : BT_DIR_LEAF;
+		if(GET16P(&blk[10])) break;
+		return blkno_ok(blk, 0x10, blkadr) && xfs_cksum_ok(blk, len, 0x0c) ? type : type | BT_BAD;
+	}
+	}
+
+	if(GET16P(blk) == XFS_DINODE_MAGIC && blk[4] >= 1 && blk[4] <= 3 && blk[5] <= XFS_DINODE_FMT_UUID)
+		return inodes(blk, len);
+
+	if(blk[0] == 0 && !memcmp(blk, blk+1, len-1)) return BT_ZERO;
+	return BT_DATA;
+}
+
+/* Maps a census file. Returns the per-block bytes; the map must be of this
+   filesystem. */
+uint8_t *census_load(const char *path, int writable, uint64_t *nblocks)
+{
+	int fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if(fd < 0) { eprintf(ERR, "Failed to open %s:", path); return NULL; }
+	struct stat st;
+	if(fstat(fd, &st) < 0) { eprintf(ERR, "fstat() failed:"); close(fd); return NULL; }
+
+	void *p = MAP_FAILED;
+	if(st.st_size >= (off_t)sizeof(struct census_hdr))
+		p = mmap(NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) { eprintf(ERR, "Can't map %s:", path); return NULL; }
+
+	struct census_hdr *h = p;
+	if(memcmp(h->magic, CENSUS_MAGIC, 8) || st.st_size != (off_t)(sizeof(*h) + h->nblocks) ||
+			h->blocksize != GET32(g_sb.sb_blocksize) || h->agblocks != GET32(g_sb.sb_agblocks)) {
+		eprintf(ERR, "%s is not a block map of this filesystem", path);
+		munmap(p, st.st_size);
+		return NULL;
+	}
+	*nblocks = h->nblocks;
+	return (uint8_t*)p + sizeof(*h);
+}
+
+#ifdef BUILDPROGCENSUS
+static const char *g_progname = "xfsr-census";
+
+static int census_create(const char *path)
+{
+	struct census_hdr h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CENSUS_MAGIC, 8);
+	h.blocksize = GET32(g_sb.sb_blocksize);
+	h.agblocks = GET32(g_sb.sb_agblocks);
+	h.agcount = GET32(g_sb.sb_agcount);
+	h.nblocks = GET64(g_sb.sb_dblocks);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if(fd < 0) { eprintf(ERR, "Failed to create %s:", path); return -1; }
+	/* The rest is a hole, which reads as BT_UNSCANNED */
+	if(write(fd, &h, sizeof(h)) != sizeof(h) || ftruncate(fd, sizeof(h) + h.nblocks) < 0) {
+		eprintf(ERR, "Failed to write %s:", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/* Per AG counts: the heat map */
+static void summary(const uint8_t *map, uint64_t nblocks)
+{
+	uint64_t agblocks = GET32(g_sb.sb_agblocks), ag, b;
+	unsigned t;
+
+	printf("ag");
+	for(t=0; t<BT_NTYPES; t++) printf("\t%s", g_names[t]);
+	printf("\tbad\n");
+	for(ag=0; ag*agblocks < nblocks; ag++) {
+		uint64_t count[BT_NTYPES] = { 0 }, bad = 0;
+		uint64_t end = (ag+1)*agblocks < nblocks ? (ag+1)*agblocks : nblocks;
+		for(b=ag*agblocks; b<end; b++) {
+			count[map[b] & ~BT_BAD]++;
+			bad += map[b] >> 7;
+		}
+		printf("%llu", (unsigned long long)ag);
+		for(t=0; t<BT_NTYPES; t++) printf("\t%llu", (unsigned long long)count[t]);
+		printf("\t%llu\n", (unsigned long long)bad);
+	}
+}
+
+void usage()
+{
+	printf("Classify every block by its header into a block map, and print per AG counts\n");
+	printf("usage: %s [-v -M -L logfile -s startblk -e endblk] -o mapfile devfile\n", g_progname);
+	printf("       %s [-l type [-b]] -m mapfile devfile\n", g_progname);
+	printf("-l lists the block addresses of one type (with -b, only the bad ones).\n");
+	printf("Types: ");
+	unsigned t;
+	for(t=0; t<BT_NTYPES; t++) printf("%s%s", g_names[t], t+1<BT_NTYPES ? " " : "\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c, badonly = 0;
+	char *devfile = NULL, *mapfile = NULL, *list = NULL;
+	int scan = 0;
+	uint64_t start = 0, end = 0;
+
+	while( (c=getopt(argc,argv,"vML:s:e:o:m:l:b")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 's':
+			start = strtoull(optarg,0,0);
+			break;
+		case 'e':
+			end = strtoull(optarg,0,0);
+			break;
+		case 'o':
+			mapfile = optarg;
+			scan = 1;
+			break;
+		case 'm':
+			mapfile = optarg;
+			break;
+		case 'l':
+			list = optarg;
+			break;
+		case 'b':
+			badonly = 1;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind>=argc || !mapfile) {
+		usage();
+		exit(0);
+	}
+
+	devfile = argv[optind];
+
+	FILE *devfp = dev_open(devfile);
+	if(!devfp) { perror(strerror(errno)); exit(errno); }
+
+	if(read_sb(devfp) <0) {
+		eprintf(ERR, "Not a valid superblock");
+		exit(2);
+	}
+	sb_print();
+
+	if(scan && access(mapfile, F_OK) < 0 && census_create(mapfile) < 0) exit(1);
+	uint64_t nblocks;
+	uint8_t *map = census_load(mapfile, scan, &nblocks);
+	if(!map) exit(1);
+
+	if(list) {
+		int type = census_type(list);
+		if(type < 0) { usage(); exit(1); }
+		uint64_t b;
+		for(b=0; b<nblocks; b++)
+			if((map[b] & ~BT_BAD) == type && (!badonly || (map[b] & BT_BAD)))
+				printf("0x%llx\n", (unsigned long long)b);
+		return 0;
+	}
+
+	if(scan) {
+		uint32_t blocksize = GET32(g_sb.sb_blocksize);
+		unsigned perchunk = CENSUS_CHUNK / blocksize;
+		unsigned char *buf = malloc(CENSUS_CHUNK);
+		if(!buf) { perror(strerror(errno)); exit(errno); }
+		dev_advise(DEV_SEQUENTIAL);
+
+		if(!end || end > nblocks) end = nblocks;
+		uint64_t blkadr = start, unreadable = 0;
+		while(blkadr < end) {
+			unsigned n = end - blkadr < perchunk ? end - blkadr : perchunk;
+			const unsigned char *chunk = dev_get(devfp, blkadr << g_sb.sb_blocklog, (size_t)n*blocksize, buf);
+			if(!chunk && n > 1) {
+				/* Go block by block through the bad spot, then speed up again */
+				uint64_t stop = blkadr + n;
+				for(; blkadr < stop; blkadr++) {
+					const unsigned char *blk = dev_get(devfp, blkadr << g_sb.sb_blocklog, blocksize, buf);
+					map[blkadr] = blk ? census_classify(blk, blocksize, blkadr) : BT_UNREADABLE;
+					unreadable += !blk;
+				}
+				continue;
+			}
+			unsigned i;
+			for(i=0; i<n; i++, blkadr++) {
+				map[blkadr] = chunk ? census_classify(chunk + (size_t)i*blocksize, blocksize, blkadr) : BT_UNREADABLE;
+				unreadable += !chunk;
+			}
+			if(blkadr % (1<<20) < n)
+				TRACE("census: current block=0x%llx", blkadr);
+		}
+		if(unreadable) eprintf(WARN, "%llu blocks could not be read", unreadable);
+		free(buf);
+	}
+
+	summary(map, nblocks);
+	return 0;
+}
+#endif
@@ -0,0 +1,361 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Device access. Reads go through dev_get(), which hands out a pointer
+   straight into the device when it is mmap()ed (-M, meant for image files),
+   or fills the caller's buffer with pread() otherwise. Neither path moves
+   the stdio file position, so callers don't need to save/restore it.
+
+   The device can be several copies of one filesystem (mirror halves, images
+   from different ddrescue passes), given as "img1,img2,...". Reads are spread
+   over the copies by DEV_STRIPE sized regions, and a read that fails, or
+   whose blocks fail their magic/CRC checks, is retried on the others; the
+   best copy wins. A read waits on one copy at a time, so the copies only
+   work in parallel for callers with several threads (-j). A "map=file"
+   element logs which copy served each region ("start end source", byte
+   offsets).
+
+   "lat=ms" and "bw=MB/s" elements turn on the governor, which paces reads
+   so a failing or shared drive isn't driven into the ground: the rate is
+   halved when a read takes much longer than the target latency or fails
+   (the drive retrying internally), and creeps back up while reads stay
+   under it, never beyond bw. Reads of a mapped device (-M) fault in later,
+   out of sight, so for those only the bw ceiling holds.
+
+   A "geom=file" element makes read_sb() take the geometry from a file
+   written by xfsr-probe, for when the primary superblock is gone. */
+
+#include "xfsr.h"
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define DEV_MAXSRC 8
+#define DEV_STRIPE (1<<20)
+#define GOV_MINRATE (64<<10) /* bytes/s; slower than this doesn't help */
+#define GOV_SPIKE 4 /* times the target latency */
+
+int g_devmmap = 0;
+
+struct devsrc {
+	const char *path;
+	FILE *fp;
+	unsigned char *map;
+	uint64_t size;
+	uint64_t served, fallbacks; /* bytes returned, and of those, read after another copy failed */
+};
+
+static struct {
+	FILE *fp; /* the first source; callers pass this to dev_get() */
+	struct devsrc src[DEV_MAXSRC];
+	unsigned n;
+	FILE *srcmap;
+	uint64_t runstart, runend;
+	unsigned runsrc;
+	pthread_mutex_t lock;
+} g_dev = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* The governor. Latencies are per DEV_STRIPE; smaller reads count as one. */
+static struct {
+	double target, cap; /* s, bytes/s; 0 if not set */
+	double rate; /* current ceiling in bytes/s, 0 for none */
+	double lat, tput; /* smoothed latency, and throughput while reading */
+	double next; /* when the next read may start */
+	unsigned backoffs;
+	pthread_mutex_t lock;
+} g_gov = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Takes a slot of len bytes at the current rate, and sleeps until it starts.
+   Returns the time the read starts. */
+static double gov_wait(size_t len)
+{
+	pthread_mutex_lock(&g_gov.lock);
+	double t = now(), start = g_gov.next > t ? g_gov.next : t;
+	g_gov.next = start + (g_gov.rate > 0 ? len / g_gov.rate : 0);
+	pthread_mutex_unlock(&g_gov.lock);
+
+	if(start > t) {
+		struct timespec ts = { (time_t)(start-t), (long)((start-t - (time_t)(start-t)) * 1e9) };
+		while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+	}
+	return start;
+}
+
+/* A spike or a failure halves the rate and pauses for as long as the read
+   took; otherwise the rate moves by 1/16, up while the smoothed latency is
+   under target, down while it is over. */
+static void gov_done(size_t len, double start, int ok)
+{
+	double t = now(), lat = t - start;
+	double per = len > DEV_STRIPE ? lat * DEV_STRIPE / len : lat;
+
+	pthread_mutex_lock(&g_gov.lock);
+	if(ok && lat > 0) g_gov.tput = g_gov.tput ? 0.875*g_gov.tput + 0.125*len/lat : len/lat;
+	if(g_gov.target > 0 && (!ok || per > GOV_SPIKE*g_gov.target)) {
+		double base = g_gov.rate > 0 ? g_gov.rate : g_gov.tput;
+		g_gov.rate = base/2 > GOV_MINRATE ? base/2 : GOV_MINRATE;
+		if(g_gov.next < t + lat) g_gov.next = t + lat;
+		g_gov.lat = per;
+		g_gov.backoffs++;
+		TRACE("gov: %llu us read, rate down to %llu KB/s", lat*1e6, g_gov.rate/1024);
+	} else if(g_gov.target > 0) {
+		g_gov.lat = g_gov.lat ? 0.875*g_gov.lat + 0.125*per : per;
+		if(g_gov.lat < g_gov.target) {
+			if(g_gov.rate > 0) g_gov.rate += g_gov.rate/16;
+		} else g_gov.rate = (g_gov.rate > 0 ? g_gov.rate : g_gov.tput) * 15/16;
+		/* Past twice what the drive gives, the ceiling doesn't bind anymore */
+		if(g_gov.rate > 2*g_gov.tput && !g_gov.cap) g_gov.rate = 0;
+	}
+	if(g_gov.cap && (!g_gov.rate || g_gov.rate > g_gov.cap)) g_gov.rate = g_gov.cap;
+	if(g_gov.rate && g_gov.rate < GOV_MINRATE) g_gov.rate = GOV_MINRATE;
+	pthread_mutex_unlock(&g_gov.lock);
+}
+
+static int src_open(struct devsrc *src, const char *path)
+{
+	src->path = path;
+	src->fp = fopen(path, "r");
+	if(!src->fp || !g_devmmap) return src->fp ? 0 : -1;
+
+	int fd = fileno(src->fp);
+	off_t size = lseek(fd, 0, SEEK_END);
+	lseek(fd, 0, SEEK_SET);
+	if(size <= 0) {
+		eprintf(WARN, "Can't determine size of %s, not mapping it", path);
+		return 0;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		eprintf(WARN, "mmap() failed, falling back to read():");
+		return 0;
+	}
+
+	src->map = map;
+	src->size = size;
+	eprintf(INFO, "Mapped %s, %llu bytes", path, (unsigned long long)size);
+	return 0;
+}
+
+static void srcmap_flush(void)
+{
+	if(g_dev.runend > g_dev.runstart)
+		fprintf(g_dev.srcmap, "0x%llx\t0x%llx\t%s\n", (unsigned long long)g_dev.runstart, (unsigned long long)g_dev.runend, g_dev.src[g_dev.runsrc].path);
+	g_dev.runstart = g_dev.runend = 0;
+}
+
+static void dev_close(void)
+{
+	unsigned i;
+	if(g_dev.srcmap) {
+		srcmap_flush();
+		fclose(g_dev.srcmap);
+	}
+	for(i=0; i<g_dev.n; i++)
+		eprintf(INFO, "%s: %llu bytes served, %llu after a failure elsewhere",
+			g_dev.src[i].path, g_dev.src[i].served, g_dev.src[i].fallbacks);
+	if(g_gov.target > 0 && !g_gov.rate)
+		eprintf(INFO, "Governor: backed off %u times, ending unlimited (%.1f ms per read)", g_gov.backoffs, g_gov.lat*1e3);
+	else if(g_gov.target > 0 || g_gov.cap > 0)
+		eprintf(INFO, "Governor: backed off %u times, ending at %.0f KB/s (%.1f ms per read)",
+			g_gov.backoffs, g_gov.rate/1024, g_gov.lat*1e3);
+}
+
+/* A list is only split if path isn't a file by itself */
+FILE *dev_open(const char *path)
+{
+	if(!strchr(path, ',') || access(path, F_OK) == 0) {
+		if(src_open(&g_dev.src[0], path) < 0) return NULL;
+		g_dev.fp = g_dev.src[0].fp;
+		g_dev.n = 1;
+		dev_advise(DEV_RANDOM);
+		return g_dev.fp;
+	}
+
+	char *list = strdup(path), *save, *tok;
+	if(!list) return NULL;
+	for(tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if(!strncmp(tok, "map=", 4)) {
+			if(!(g_dev.srcmap = fopen(tok+4, "w"))) return NULL;
+			continue;
+		}
+		if(!strncmp(tok, "geom=", 5)) {
+			g_geometry = tok+5;
+			continue;
+		}
+		if(!strncmp(tok, "lat=", 4)) {
+			g_gov.target = atof(tok+4) / 1e3;
+			continue;
+		}
+		if(!strncmp(tok, "bw=", 3)) {
+			g_gov.rate = g_gov.cap = atof(tok+3) * (1<<20);
+			continue;
+		}
+		if(g_dev.n == DEV_MAXSRC) {
+			eprintf(ERR, "At most %d sources", DEV_MAXSRC);
+			errno = EINVAL;
+			return NULL;
+		}
+		if(src_open(&g_dev.src[g_dev.n], tok) < 0) return NULL;
+		g_dev.n++;
+	}
+	if(!g_dev.n) { errno = EINVAL; return NULL; }
+
+	g_dev.fp = g_dev.src[0].fp;
+	dev_advise(DEV_RANDOM);
+	atexit(dev_close);
+	eprintf(INFO, "Reading from %u copies", g_dev.n);
+	return g_dev.fp;
+}
+
+/* Tell the kernel how the mapping is about to be used: metadata walks jump
+   around (DEV_RANDOM, no readahead), scans sweep it (DEV_SEQUENTIAL). */
+void dev_advise(int pattern)
+{
+	unsigned i;
+	int advice = pattern == DEV_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM;
+	for(i=0; i<g_dev.n; i++)
+		if(g_dev.src[i].map && madvise(g_dev.src[i].map, g_dev.src[i].size, advice) != 0)
+			eprintf(WARN, "madvise() failed:");
+}
+
+static const unsigned char *pread_get(FILE *fp, uint64_t off, size_t len, void *buf)
+{
+	size_t done = 0;
+	while(done < len) {
+		ssize_t n = pread(fileno(fp), (char*)buf + done, len - done, off + done);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return NULL;
+		done += n;
+	}
+	return buf;
+}
+
+static const unsigned char *src_get(const struct devsrc *src, uint64_t off, size_t len, void *buf)
+{
+	int gov = g_gov.target > 0 || g_gov.cap > 0;
+	if(src->map) {
+		if(off > src->size || len > src->size - off) return NULL;
+		if(gov) gov_wait(len);
+		return src->map + off;
+	}
+	if(!gov) return pread_get(src->fp, off, len, buf);
+
+	double start = gov_wait(len);
+	const unsigned char *p = pread_get(src->fp, off, len, buf);
+	gov_done(len, start, p != NULL);
+	return p;
+}
+
+/* Number of blocks (or, for reads of single inodes, inodes) in p that fail
+   their checks. Nothing can be checked before the superblock is in. */
+static unsigned bad_units(const unsigned char *p, size_t len, uint64_t off)
+{
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	unsigned inodesize = GET16(g_sb.sb_inodesize), bad = 0;
+	size_t k;
+	if(!blocksize || !GET32(g_sb.sb_agblocks)) return 0;
+
+	if(off % blocksize == 0 && len % blocksize == 0) {
+		for(k=0; k<len; k+=blocksize)
+			if(census_classify(p+k, blocksize, (off+k) >> g_sb.sb_blocklog) & BT_BAD) bad++;
+	} else if(inodesize && off % inodesize == 0 && len % inodesize == 0) {
+		for(k=0; k<len; k+=inodesize)
+			if(GET16P(p+k) == XFS_DINODE_MAGIC && !inode_crc_ok(p+k)) bad++;
+	}
+	return bad;
+}
+
+static void src_record(unsigned i, uint64_t off, size_t len, int fallback)
+{
+	pthread_mutex_lock(&g_dev.lock);
+	g_dev.src[i].served += len;
+	if(fallback) g_dev.src[i].fallbacks += len;
+	if(g_dev.srcmap) {
+		if(i != g_dev.runsrc || off != g_dev.runend) {
+			srcmap_flush();
+			g_dev.runsrc = i;
+			g_dev.runstart = g_dev.runend = off;
+		}
+		g_dev.runend += len;
+	}
+	pthread_mutex_unlock(&g_dev.lock);
+}
+
+/* The copy that owns the stripe goes first; the others are only read if it
+   fails. A copy whose data has fewer bad units replaces the best so far,
+   which is kept out of harm's way in buf or tmp. */
+static const unsigned char *multi_get(uint64_t off, size_t len, void *buf)
+{
+	unsigned first = (off / DEV_STRIPE) % g_dev.n, bad = UINT_MAX, from = 0, k;
+	const unsigned char *p = NULL;
+	unsigned char *tmp = NULL;
+
+	for(k=0; k<g_dev.n && bad; k++) {
+		unsigned i = (first+k) % g_dev.n;
+		void *dst = p == buf ? (void*)tmp : buf;
+		if(!dst && !(dst = tmp = malloc(len))) { eprintf(ERR, "malloc() failed:"); break; }
+		const unsigned char *q = src_get(&g_dev.src[i], off, len, dst);
+		if(!q) {
+			TRACE("dev: source %llu failed at 0x%llx", i, off);
+			continue;
+		}
+		unsigned b = bad_units(q, len, off);
+		if(b) TRACE("dev: source %llu has %llu bad units at 0x%llx", i, b, off);
+		if(b < bad) p = q, from = i, bad = b;
+	}
+
+	if(p && p == tmp) {
+		memcpy(buf, tmp, len);
+		p = buf;
+	}
+	free(tmp);
+	if(p) src_record(from, off, len, from != first);
+	return p;
+}
+
+/* Returns len bytes at byte offset off, either as a pointer into the mapped
+   device or copied into buf. NULL on a short read. */
+const unsigned char *dev_get(FILE *fp, uint64_t off, size_t len, void *buf)
+{
+	if(fp != g_dev.fp) return pread_get(fp, off, len, buf);
+	if(g_dev.n > 1) return multi_get(off, len, buf);
+	return src_get(&g_dev.src[0], off, len, buf);
+}
+
+/* Like dev_get(), but always copies into buf. Returns 0 or -1. */
+int dev_read(FILE *fp, void *buf, size_t len, uint64_t off)
+{
+	const unsigned char *p = dev_get(fp, off, len, buf);
+	if(!p) return -1;
+	if(p != buf) memcpy(buf, p, len);
+	return 0;
+}
@@ -0,0 +1,250 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Directory parsing: shortform, block and data-block (extent) directories
+   are read into a dirlist of (ino, name) pairs. Used by xfsr-ls and
+   xfsr-index; neither the children's inodes nor leaf blocks are touched. */
+
+#include "xfsr.h"
+#include <string.h>
+
+int dirlist_add(dirlist_t *dl, uint64_t ino, const char *name)
+{
+	size_t len = strlen(name) + 1;
+	if(dl->n == dl->cap) {
+		size_t cap = dl->cap ? 2*dl->cap : 64;
+		uint64_t *i = realloc(dl->ino, cap*sizeof(uint64_t));
+		if(i) dl->ino = i;
+		size_t *o = realloc(dl->nameoff, cap*sizeof(size_t));
+		if(o) dl->nameoff = o;
+		if(!i || !o) { eprintf(ERR, "realloc() failed:"); return -1; }
+		dl->cap = cap;
+	}
+	if(dl->namesize + len > dl->namecap) {
+		size_t cap = dl->namecap ? 2*dl->namecap : 4096;
+		while(cap < dl->namesize + len) cap *= 2;
+		char *p = realloc(dl->names, cap);
+		if(!p) { eprintf(ERR, "realloc() failed:"); return -1; }
+		dl->names = p;
+		dl->namecap = cap;
+	}
+	memcpy(&dl->names[dl->namesize], name, len);
+	dl->ino[dl->n] = ino;
+	dl->nameoff[dl->n++] = dl->namesize;
+	dl->namesize += len;
+	return 0;
+}
+
+void dirlist_free(dirlist_t *dl)
+{
+	free(dl->ino);
+	free(dl->nameoff);
+	free(dl->names);
+	memset(dl, 0, sizeof(*dl));
+}
+
+static int dir_local(FILE *devfp, uint64_t g_iadr, dirlist_t *dl)
+{
+	unsigned inodesize = GET16(g_sb.sb_inodesize);
+	unsigned char buf[inodesize];
+	const unsigned char *inode = dev_get(devfp, iadr_to_off(g_iadr), inodesize, buf);
+	if(!inode) { eprintf(ERR, "Failed to read local dir at iadr=0%Lx:", g_iadr); return -1; }
+	const xfs_dir2_sf_hdr_t *dir2_hdr = (const xfs_dir2_sf_hdr_t*)&inode[INO_DATA_FORK_OFFSET];
+	unsigned count=0, inolen=0;
+	if(dir2_hdr->count) count=dir2_hdr->count, inolen = 4;
+	else if(dir2_hdr->i8count) count=dir2_hdr->i8count, inolen = 8;
+	else { eprintf(ERR, "Corrupted local dir at iadr=0%Lx", g_iadr); return -1; }
+
+	const unsigned char *p = &inode[INO_DATA_FORK_OFFSET] + 1+1;
+	unsigned i;
+
+	uint64_t parent_ino = inolen==4 ? GET32(*((uint32_t*)p)) : GET64(*((uint64_t*)p));
+	p+=inolen;
+
+	int err = dirlist_add(dl, iadr_to_ino(g_iadr), ".");
+	if(!err) err = dirlist_add(dl, parent_ino, "..");
+
+	for(i=0; i<count && !err; i++) {
+			uint8_t namelen = *p++;
+			//uint16_t offset = GET16(*((uint16_t*)p)); //FIXME: what the heck is this offset?
+			p+=2;
+			char name[namelen+1];
+			memcpy(name,p,namelen);
+			p+=namelen;
+			name[namelen] = '\0';
+			if(g_ftype) p++;
+			uint64_t ino;
+			ino = inolen==4 ? GET32P(p) : GET64P(p);
+			p+=inolen;
+			err = dirlist_add(dl, ino, name);
+	}
+	return err;
+}
+
+static int read_dir2_block(unsigned offset, const char *blockp, char *name, uint64_t *inop)
+{
+	const uint64_t *blockp64 = (const uint64_t*)blockp;
+	const uint8_t *ublockp = (const uint8_t*)blockp;
+	*inop = GET64(*blockp64);
+
+	unsigned len;
+	unsigned size;
+	unsigned tag;
+	if(*inop>>48 == 0xffff) {
+		len = (*inop>>32) & 0xffff;
+		size = len;
+		tag = blockp[size-2];
+	} else {
+		len = ublockp[8];
+		memcpy(name, &ublockp[9], len);
+		name[len] = '\0';
+
+		size=8+1+len+2; // 8 for inode adr, 1 for strlen, len for name, 2 for tag
+		if(g_ftype) size++; // file type byte after the name
+		unsigned size_raw = size;
+		if(size&7) size += 8-(size&7); // align to 8-bytes boundary
+
+	}
+
+	tag = (((unsigned)ublockp[size-2])<<8) + ublockp[size-1];
+
+	if(offset != tag && len != 0) {
+		eprintf(WARN,"Block dir tag doesn't match the offset (tag=0x%x,offset=0x%x,size=0x%x)\n",
+			tag, offset, size);
+	}
+	return tag==0 || len == 0 ? 0 :size;
+
+}
+
+static int dir_extents_block(unsigned nblocks, FILE *fp, xfs_bmbt_irec_t *irec, uint64_t g_iadr, dirlist_t *dl)
+{
+	TRACE("dir block: blkadr=0x%llx blkno=0x%llx",
+		blkno_to_blkadr(irec->br_startblock), irec->br_startblock);
+
+	if(irec->br_startoff == 1LL<<(35-g_sb.sb_blocklog)) {
+		eprintf(WARN, "Extent dirs' leaves are not handled");
+		return 0;
+	}
+
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	char buf[blocksize];
+	const char *block = (const char*)dev_get(fp, blkno_to_off(irec->br_startblock), blocksize, buf);
+	if(!block) {
+		eprintf(ERR, "Failed to read dir block:");
+		return -1;
+	}
+
+	// Verify magic
+	uint32_t magic = GET32P(block);
+	uint32_t want = g_v5 ? (nblocks==1 ? XFS_DIR3_BLOCK_MAGIC : XFS_DIR3_DATA_MAGIC)
+		: (nblocks==1 ? XFS_DIR2_BLOCK_MAGIC : XFS_DIR2_DATA_MAGIC);
+	if(magic != want) {
+		eprintf(ERR, "Dir block magic failed: 0x%x", magic);
+		return -1;
+	}
+	if(g_v5 && !xfs_cksum_ok(block, blocksize, 4))
+		eprintf(WARN, "Dir block 0x%llx CRC mismatch", irec->br_startblock);
+
+	// Read & print out entries
+	char name[255+1];
+	const char *p = &block[g_v5 ? 0x40 : 0x10];
+	uint64_t ino;
+	unsigned nentries=0;
+
+	do {
+		int size = read_dir2_block((unsigned long)p - (unsigned long)block, p,name, &ino);
+		if(size == 0) break;
+		p += size;
+
+		if(p>=&block[blocksize]) // end of block
+			break;
+
+		if( (ino>>48)==0xffff ) // unlinked entry
+			continue;
+
+		uint64_t iadr = ino_to_iadr(ino);
+
+		if(nentries == 0 && !strcmp(".", name) && iadr != g_iadr) {
+			eprintf(ERR,"Entry . doesnt point to itself (g_iadr=0x%llx)", iadr);
+			return -2;
+		}
+		if(dirlist_add(dl, ino, name) < 0) return -1;
+		nentries++;
+	} while(p<&block[blocksize]);
+
+	return (int)nentries;
+}
+
+
+static int dir_extents(FILE *fp, xfs_dinode_t *dinode, uint64_t g_iadr, dirlist_t *dl)
+{
+	unsigned nextents = GET32(dinode->di_core.di_nextents);
+	static extmap_t map; /* the directory is parsed fully before anyone recurses */
+
+	if(extmap_load(fp, g_iadr, dinode, &map) < 0)
+		return -1;
+
+	size_t i, first = dl->n;
+	for(i=0; i<map.n; i++) {
+		xfs_bmbt_irec_t irec;
+		irec.br_startoff = map.startoff[i];
+		irec.br_startblock = map.startblock[i];
+		irec.br_blockcount = map.count[i];
+		irec.br_state = map.state[i];
+		if(dir_extents_block(nextents,fp,&irec,g_iadr,dl) < 0)
+			return -1;
+	}
+
+	if(dl->n - first < 2) {
+		eprintf(ERR,"A directory must have at least 2 entries");
+		return -1;
+	}
+
+	TRACE("dir: %llu entries in total", dl->n - first);
+	return 0;
+}
+
+static int dir_btree(FILE *fp, xfs_dinode_t *dinode, dirlist_t *dl)
+{
+	eprintf(ERR, "B+ tree directories are not handled yet.");
+	return -80;
+}
+
+/* Appends the entries of the directory at iadr (whose core is dinode) to dl,
+   "." and ".." included. Nothing is read beyond the directory itself. */
+int dir_collect(FILE *fp, uint64_t iadr, xfs_dinode_t *dinode, dirlist_t *dl)
+{
+	switch(dinode->di_core.di_format)
+	{
+		case XFS_DINODE_FMT_LOCAL:
+			return dir_local(fp,iadr,dl);
+
+		case XFS_DINODE_FMT_EXTENTS:
+			return dir_extents(fp,dinode,iadr,dl);
+
+		case XFS_DINODE_FMT_BTREE:
+			return dir_btree(fp,dinode,dl);
+
+		default:
+			eprintf(ERR, "Unknown/unhandled dir format");
+			return -1;
+	}
+}
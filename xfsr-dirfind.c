@@ -24,14 +24,18 @@
 
 static const char *g_progname = "xfsr-dirfind";
 
-static inline int _isdir(FILE *devfp, uint64_t inode)
+#define DIRFIND_CHUNK (1<<20)
+
+#ifdef BUILDPROGDIRFIND
+/* Prints the directory inodes among the n at p, the first being inode. */
+static void print_dirs(const unsigned char *p, unsigned n, uint64_t inode)
 {
-	xfs_dinode_t dinode;
-	if(read_inode(devfp, &dinode, inode) < 0) return 0;
-	return dinode_isdir(&dinode);
+	unsigned inodesize = 1 << g_sb.sb_inodelog, i;
+	for(i=0; i<n; i++, p+=inodesize)
+		if(p[0]=='I' && p[1]=='N' && dinode_isdir((const xfs_dinode_t*)p) && inode_crc_ok(p))
+			printf("0x%llx\n", (unsigned long long)(inode+i));
 }
 
-#ifdef BUILDPROGDIRFIND
 void usage()
 {
 
@@ -44,7 +48,7 @@ int main(int argc, char *argv[])
 	uint64_t inode=0;
 	setlocale(LC_ALL, "");
 
-	while( (c=getopt(argc,argv,"vI")) != EOF ) {
+	while( (c=getopt(argc,argv,"vI:M")) != EOF ) {
 
 		switch(c) {
 		case 'I':
@@ -53,6 +57,9 @@ int main(int argc, char *argv[])
 		case 'v':
 			g_verbose++;
 			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
 		default:
 			usage();
 			exit(0);
@@ -66,7 +73,7 @@ int main(int argc, char *argv[])
 
 	devfile = argv[optind];
 
-	FILE *devfp = fopen(devfile, "r");
+	FILE *devfp = dev_open(devfile);
 	if(!devfp) { perror(strerror(errno)); exit(errno); }
 
 	if(read_sb(devfp) <0) {
@@ -74,16 +81,49 @@ int main(int argc, char *argv[])
 		exit(2);
 	}
 	uint32_t inodesize = 1<< g_sb.sb_inodelog;
-	seek_iadr(devfp, inode);
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	unsigned perchunk = DIRFIND_CHUNK / inodesize, perblock = blocksize / inodesize;
+	uint64_t end = GET64(g_sb.sb_dblocks) << g_sb.sb_inopblog, unreadable = 0;
+	unsigned char *buf = malloc(DIRFIND_CHUNK);
+	if(!buf) { perror(strerror(errno)); exit(errno); }
+	dev_advise(DEV_SEQUENTIAL);
 
-	while( (c=fgetc(devfp)) != EOF ) {
-		if(c=='I') {
-			if( (c=fgetc(devfp)) == 'N' && _isdir(devfp, inode)) { printf("0x%llx\n", inode); }
-			fseek(devfp,inodesize-2,SEEK_CUR);
-		} else {
-			fseek(devfp,inodesize-1,SEEK_CUR);
+	/* Whole chunks at a time. A chunk that can't be read is gone through
+	   block by block; runs of unreadable blocks are skipped with one warning
+	   each, then the scan speeds up again. */
+	uint64_t badstart = 0, badend = 0;
+	while(inode < end) {
+		unsigned n = end - inode < perchunk ? end - inode : perchunk;
+		const unsigned char *p = dev_get(devfp, iadr_to_off(inode), (size_t)n*inodesize, buf);
+		if(!p) {
+			uint64_t stop = inode + n;
+			while(inode < stop) {
+				/* Up to the next block boundary, in case -I isn't on one */
+				unsigned k = perblock - inode % perblock;
+				if(k > stop - inode) k = stop - inode;
+				p = dev_get(devfp, iadr_to_off(inode), (size_t)k*inodesize, buf);
+				if(!p) {
+					if(inode != badend) {
+						if(badend) eprintf(WARN, "Inodes 0x%llx-0x%llx are unreadable, skipped", badstart, badend-1);
+						badstart = inode;
+					}
+					unreadable++;
+					inode += k;
+					badend = inode;
+					continue;
+				}
+				print_dirs(p, k, inode);
+				inode += k;
+			}
+			continue;
 		}
-		inode++;
+		print_dirs(p, n, inode);
+		inode += n;
+	}
+	if(badend) eprintf(WARN, "Inodes 0x%llx-0x%llx are unreadable, skipped", badstart, badend-1);
+	if(unreadable) {
+		eprintf(ERR, "%llu blocks could not be read, the list is incomplete", unreadable);
+		return 3;
 	}
 
 	return 0;
@@ -0,0 +1,302 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Extent maps: the data fork of an inode decoded into four parallel arrays
+   (startoff, startblock, count, state). Records are decoded in batches:
+   byte-swap the whole batch first, then pull the bitfields out in straight
+   loops the compiler can vectorize. */
+
+#include "xfsr.h"
+#include <string.h>
+#if defined(__SSSE3__)
+# include <tmmintrin.h>
+#endif
+
+#define EXTMAP_BATCH 64
+
+void extmap_init(extmap_t *m)
+{
+	memset(m, 0, sizeof(*m));
+}
+
+void extmap_free(extmap_t *m)
+{
+	free(m->startoff);
+	free(m->startblock);
+	free(m->count);
+	free(m->state);
+	free(m->buf);
+	free(m->bmblk);
+	extmap_init(m);
+}
+
+/* Buffers are kept, so a map can be reused for the next file without
+   going back to malloc. */
+void extmap_reset(extmap_t *m)
+{
+	m->n = 0;
+	m->nbmblk = 0;
+}
+
+static int extmap_reserve(extmap_t *m, size_t n)
+{
+	if(n <= m->cap) return 0;
+	if(n > EXTMAP_MAXRECS) {
+		eprintf(ERR, "Extent map would hold %zu records, refusing (max %u)", n, EXTMAP_MAXRECS);
+		return -1;
+	}
+
+	size_t cap = m->cap ? m->cap : 64;
+	while(cap < n) cap *= 2;
+	if(cap > EXTMAP_MAXRECS) cap = EXTMAP_MAXRECS;
+
+	uint64_t *so = realloc(m->startoff, cap*sizeof(uint64_t));
+	if(so) m->startoff = so;
+	uint64_t *sb = realloc(m->startblock, cap*sizeof(uint64_t));
+	if(sb) m->startblock = sb;
+	uint32_t *c = realloc(m->count, cap*sizeof(uint32_t));
+	if(c) m->count = c;
+	uint8_t *st = realloc(m->state, cap);
+	if(st) m->state = st;
+	if(!so || !sb || !c || !st) { eprintf(ERR, "realloc() failed:"); return -1; }
+
+	m->cap = cap;
+	return 0;
+}
+
+/* Scratch buffer of at least size bytes, owned by the map. */
+static unsigned char *extmap_buf(extmap_t *m, size_t size)
+{
+	if(size > m->bufsize) {
+		unsigned char *p = realloc(m->buf, size);
+		if(!p) { eprintf(ERR, "realloc() failed:"); return NULL; }
+		m->buf = p;
+		m->bufsize = size;
+	}
+	return m->buf;
+}
+
+/* Byte-swaps n (<= EXTMAP_BATCH) on-disk records into host order, l0/l1
+   interleaved in out[]. */
+static inline void extmap_swap_batch(const xfs_bmbt_rec_64_t *recs, uint64_t *out, unsigned n)
+{
+	unsigned i;
+#if defined(__SSSE3__)
+	const __m128i shuf = _mm_set_epi8(8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7);
+	for(i=0; i<n; i++) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&recs[i]);
+		_mm_storeu_si128((__m128i*)&out[2*i], _mm_shuffle_epi8(v, shuf));
+	}
+#else
+	const uint64_t *raw = (const uint64_t*)recs;
+	for(i=0; i<2*n; i++)
+		out[i] = GET64(raw[i]);
+#endif
+}
+
+/* Appends n on-disk bmbt records to the map. */
+int extmap_decode(extmap_t *m, const xfs_bmbt_rec_64_t *recs, size_t n)
+{
+	if(extmap_reserve(m, m->n + n) < 0) return -1;
+
+	uint64_t l[2*EXTMAP_BATCH];
+	size_t done;
+	for(done=0; done<n; ) {
+		unsigned b = n-done > EXTMAP_BATCH ? EXTMAP_BATCH : n-done, i;
+		uint64_t *so = &m->startoff[m->n], *sb = &m->startblock[m->n];
+		uint32_t *c = &m->count[m->n];
+		uint8_t *st = &m->state[m->n];
+
+		extmap_swap_batch(&recs[done], l, b);
+		for(i=0; i<b; i++)
+			so[i] = (l[2*i] & XFS_MASK64LO(63)) >> 9;
+		for(i=0; i<b; i++)
+			sb[i] = ((l[2*i] & XFS_MASK64LO(9)) << 43) | (l[2*i+1] >> 21);
+		for(i=0; i<b; i++)
+			c[i] = l[2*i+1] & XFS_MASK64LO(21);
+		for(i=0; i<b; i++)
+			st[i] = l[2*i] >> 63;
+
+		m->n += b;
+		done += b;
+	}
+	return 0;
+}
+
+/* Coalesces neighbours that are contiguous both in the file and on disk. */
+void extmap_merge(extmap_t *m)
+{
+	if(m->n < 2) return;
+
+	size_t i, j=0;
+	for(i=1; i<m->n; i++) {
+		uint64_t len = m->count[j];
+		if(m->state[i] == m->state[j] &&
+		   m->startoff[j]+len == m->startoff[i] &&
+		   m->startblock[j]+len == m->startblock[i] &&
+		   len + m->count[i] <= UINT32_MAX) {
+			m->count[j] += m->count[i];
+			continue;
+		}
+		j++;
+		m->startoff[j] = m->startoff[i];
+		m->startblock[j] = m->startblock[i];
+		m->count[j] = m->count[i];
+		m->state[j] = m->state[i];
+	}
+	m->n = j+1;
+}
+
+static int extmap_load_bmbt(FILE *fp, extmap_t *m, uint64_t blkno, int level)
+{
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	unsigned hdr = g_v5 ? 0x48 : 0x18; /* v5 adds blkno, lsn, uuid, owner, crc */
+	unsigned maxrecs = (blocksize - hdr) / sizeof(xfs_bmbt_rec_64_t);
+	unsigned char *buf = malloc(blocksize);
+	if(!buf) { eprintf(ERR, "malloc() failed:"); return -1; }
+
+	int err = 0;
+	TRACE("bmap block: blkno=0x%llx blkadr=0x%llx level=%llu", blkno, blkno_to_blkadr(blkno), level);
+	const unsigned char *block = dev_get(fp, blkno_to_off(blkno), blocksize, buf);
+	if(!block) {
+		eprintf(ERR, "Failed to read bmap block 0x%llx:", blkno);
+		err = -1;
+		goto out;
+	}
+
+	uint32_t magic = GET32P(&block[0]);
+	if(magic != (g_v5 ? XFS_BMAP_CRC_MAGIC : XFS_BMAP_MAGIC)) {
+		eprintf(ERR, "BMAP magic failed: 0x%x", magic);
+		err = -1;
+		goto out;
+	}
+	if(g_v5 && !xfs_cksum_ok(block, blocksize, 0x40))
+		eprintf(WARN, "BMAP block 0x%llx CRC mismatch", blkno);
+	if(GET16P(&block[4]) != level) {
+		eprintf(ERR, "BMAP block level %u, expected %d", GET16P(&block[4]), level);
+		err = -1;
+		goto out;
+	}
+
+	if(m->nbmblk == m->bmcap) {
+		size_t cap = m->bmcap ? 2*m->bmcap : 16;
+		uint64_t *p = realloc(m->bmblk, cap*sizeof(uint64_t));
+		if(!p) { eprintf(ERR, "realloc() failed:"); err = -1; goto out; }
+		m->bmblk = p;
+		m->bmcap = cap;
+	}
+	m->bmblk[m->nbmblk++] = blkno;
+
+	unsigned numrecs = GET16P(&block[6]);
+	if(numrecs > maxrecs) {
+		eprintf(WARN, "BMAP block claims %u records, only %u fit", numrecs, maxrecs);
+		numrecs = maxrecs;
+	}
+
+	if(level == 0) {
+		err = extmap_decode(m, (const xfs_bmbt_rec_64_t*)&block[hdr], numrecs);
+	} else {
+		const uint64_t *ptrs = (const uint64_t*)&block[hdr + maxrecs*sizeof(uint64_t)];
+		unsigned i;
+		for(i=0; i<numrecs && !err; i++)
+			err = extmap_load_bmbt(fp, m, GET64(ptrs[i]), level-1);
+	}
+
+out:
+	free(buf);
+	return err;
+}
+
+/* Decodes the data fork of an inode already in memory (all inodesize bytes
+   of it) into m, which is reset first. Handles both extent lists and bmap
+   B+ trees. The record counts found on disk are never trusted beyond what
+   fits in the fork or block. */
+int extmap_load_inode(FILE *fp, const unsigned char *inode, xfs_dinode_t *dinode, extmap_t *m)
+{
+	unsigned inodesize = GET16(g_sb.sb_inodesize);
+	unsigned forksize = dinode_dfork_size(dinode);
+
+	extmap_reset(m);
+	if(forksize > inodesize - INO_DATA_FORK_OFFSET) {
+		eprintf(ERR, "Bogus fork offset: 0x%x", dinode->di_core.di_forkoff);
+		return -1;
+	}
+
+	int err = 0;
+	switch(dinode->di_core.di_format) {
+	case XFS_DINODE_FMT_EXTENTS: {
+		unsigned nextents = GET32(dinode->di_core.di_nextents);
+		unsigned maxrecs = forksize / sizeof(xfs_bmbt_rec_64_t);
+		if(nextents > maxrecs) {
+			eprintf(WARN, "Inode claims %u extents, only %u fit in the fork", nextents, maxrecs);
+			nextents = maxrecs;
+		}
+		err = extmap_decode(m, (const xfs_bmbt_rec_64_t*)&inode[INO_DATA_FORK_OFFSET], nextents);
+		break;
+	}
+	case XFS_DINODE_FMT_BTREE: {
+		const xfs_bmdr_block_t *bmdr = (const xfs_bmdr_block_t*)&inode[INO_DATA_FORK_OFFSET];
+		unsigned level = GET16(bmdr->bb_level);
+		unsigned numrecs = GET16(bmdr->bb_numrecs);
+		unsigned maxrecs = (forksize - sizeof(xfs_bmdr_block_t)) / (2*sizeof(uint64_t));
+
+		TRACE("bmap root: level=%llu numrecs=0x%llx", level, numrecs);
+		if(level == 0 || level > EXTMAP_MAXLEVELS) {
+			eprintf(ERR, "Bogus bmap root level: %u", level);
+			err = -1;
+			break;
+		}
+		if(numrecs > maxrecs) {
+			eprintf(WARN, "Bmap root claims %u records, only %u fit", numrecs, maxrecs);
+			numrecs = maxrecs;
+		}
+
+		/* The inode may sit in the map's scratch buffer; copy the pointers out before descending. */
+		uint64_t ptrs[maxrecs];
+		memcpy(ptrs, &inode[INO_DATA_FORK_OFFSET + sizeof(xfs_bmdr_block_t) + maxrecs*sizeof(uint64_t)],
+			numrecs*sizeof(uint64_t));
+		unsigned i;
+		for(i=0; i<numrecs && !err; i++)
+			err = extmap_load_bmbt(fp, m, GET64(ptrs[i]), level-1);
+		break;
+	}
+	default:
+		eprintf(ERR, "Inode format %d has no extent map", dinode->di_core.di_format);
+		err = -1;
+	}
+
+	return err;
+}
+
+/* Same, reading the inode at iadr first. */
+int extmap_load(FILE *fp, uint64_t iadr, xfs_dinode_t *dinode, extmap_t *m)
+{
+	unsigned inodesize = GET16(g_sb.sb_inodesize);
+	unsigned char *buf = extmap_buf(m, inodesize);
+	if(!buf) return -1;
+
+	const unsigned char *inode = dev_get(fp, iadr_to_off(iadr), inodesize, buf);
+	if(!inode) {
+		eprintf(ERR, "Failed to read inode:");
+		return -1;
+	}
+	return extmap_load_inode(fp, inode, dinode, m);
+}
@@ -0,0 +1,147 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Streaming XXH64 (seed 0), so dumps can be checksummed while the data
+   passes through, without reading the output back. Output matches the
+   reference xxhsum -H64. */
+
+#include "xfsr.h"
+#include <string.h>
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t rd64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v; /* little endian hosts only, like the rest of xfsr */
+}
+
+static inline uint32_t rd32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t in)
+{
+	acc += in * P2;
+	acc = rotl(acc, 31);
+	return acc * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v)
+{
+	acc ^= round64(0, v);
+	return acc * P1 + P4;
+}
+
+void xxh64_init(xxh64_t *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->v[0] = P1 + P2;
+	s->v[1] = P2;
+	s->v[2] = 0;
+	s->v[3] = -P1;
+}
+
+void xxh64_update(xxh64_t *s, const void *data, size_t len)
+{
+	const unsigned char *p = data, *end = p + len;
+	s->total += len;
+
+	if(s->memsize + len < 32) {
+		memcpy(s->mem + s->memsize, p, len);
+		s->memsize += len;
+		return;
+	}
+
+	if(s->memsize) {
+		memcpy(s->mem + s->memsize, p, 32 - s->memsize);
+		p += 32 - s->memsize;
+		s->v[0] = round64(s->v[0], rd64(s->mem));
+		s->v[1] = round64(s->v[1], rd64(s->mem+8));
+		s->v[2] = round64(s->v[2], rd64(s->mem+16));
+		s->v[3] = round64(s->v[3], rd64(s->mem+24));
+		s->memsize = 0;
+	}
+
+	uint64_t v0 = s->v[0], v1 = s->v[1], v2 = s->v[2], v3 = s->v[3];
+	for(; p + 32 <= end; p += 32) {
+		v0 = round64(v0, rd64(p));
+		v1 = round64(v1, rd64(p+8));
+		v2 = round64(v2, rd64(p+16));
+		v3 = round64(v3, rd64(p+24));
+	}
+	s->v[0] = v0, s->v[1] = v1, s->v[2] = v2, s->v[3] = v3;
+
+	if(p < end) {
+		memcpy(s->mem, p, end - p);
+		s->memsize = end - p;
+	}
+}
+
+uint64_t xxh64_digest(const xxh64_t *s)
+{
+	uint64_t h;
+	if(s->total >= 32) {
+		h = rotl(s->v[0],1) + rotl(s->v[1],7) + rotl(s->v[2],12) + rotl(s->v[3],18);
+		h = merge64(h, s->v[0]);
+		h = merge64(h, s->v[1]);
+		h = merge64(h, s->v[2]);
+		h = merge64(h, s->v[3]);
+	} else {
+		h = s->v[2] + P5;
+	}
+	h += s->total;
+
+	const unsigned char *p = s->mem, *end = p + s->memsize;
+	for(; p + 8 <= end; p += 8) {
+		h ^= round64(0, rd64(p));
+		h = rotl(h, 27) * P1 + P4;
+	}
+	if(p + 4 <= end) {
+		h ^= (uint64_t)rd32(p) * P1;
+		h = rotl(h, 23) * P2 + P3;
+		p += 4;
+	}
+	for(; p < end; p++) {
+		h ^= (*p) * P5;
+		h = rotl(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
@@ -0,0 +1,508 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Filename index. Building reads every directory in an xfsr-dirfind list
+   and records (ino, parent ino, name) for each entry, plus a trigram
+   posting list over the case-folded names. Searching needs only the index:
+   the longest literal the query must contain is looked up by trigrams,
+   candidates are checked with memmem, and only those go to the regex
+   engine. Paths are rebuilt by following parent inos through the index.
+
+   File layout (host byte order):
+	header | entries (sorted by ino) | trigrams (+ sentinel) | postings | names */
+
+#define _GNU_SOURCE
+#include "xfsr.h"
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <regex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define INDEX_MAGIC "XFSRIDX1"
+#define INDEX_MAXDEPTH 256
+
+struct index_hdr {
+	char magic[8];
+	uint64_t rootino;
+	uint64_t nentries, ntri, npost, namesize;
+};
+
+struct index_ent {
+	uint64_t ino, parent;
+	uint32_t nameoff, namelen; /* names are also NUL terminated */
+};
+
+struct index_tri {
+	uint32_t tri, first; /* postings of tri are [first, next tri's first) */
+};
+
+static inline uint32_t trigram(const char *p)
+{
+	return (uint32_t)tolower((unsigned char)p[0]) << 16 |
+		(uint32_t)tolower((unsigned char)p[1]) << 8 | tolower((unsigned char)p[2]);
+}
+
+/* Searching */
+
+static const struct index_hdr *g_hdr;
+static const struct index_ent *g_ent;
+static const struct index_tri *g_tri;
+static const uint32_t *g_post;
+static const char *g_name;
+
+int index_open(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) { eprintf(ERR, "Failed to open %s:", path); return -1; }
+	struct stat st;
+	if(fstat(fd, &st) < 0) { eprintf(ERR, "fstat() failed:"); close(fd); return -1; }
+
+	void *p = st.st_size >= (off_t)sizeof(*g_hdr) ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if(p == MAP_FAILED) { eprintf(ERR, "Can't map %s:", path); return -1; }
+
+	g_hdr = p;
+	uint64_t size = sizeof(*g_hdr) + g_hdr->nentries*sizeof(*g_ent) +
+		(g_hdr->ntri+1)*sizeof(*g_tri) + g_hdr->npost*sizeof(*g_post) + g_hdr->namesize;
+	if(memcmp(g_hdr->magic, INDEX_MAGIC, 8) || size != (uint64_t)st.st_size) {
+		eprintf(ERR, "%s is not an xfsr index", path);
+		return -1;
+	}
+	g_ent = (const struct index_ent*)(g_hdr + 1);
+	g_tri = (const struct index_tri*)(g_ent + g_hdr->nentries);
+	g_post = (const uint32_t*)(g_tri + g_hdr->ntri + 1);
+	g_name = (const char*)(g_post + g_hdr->npost);
+	return 0;
+}
+
+/* Longest run of plain characters that every match of the extended regex
+   must contain, or an empty string. Anything inside a group, or any
+   alternation, is given up on. */
+static void regex_literal(const char *re, char *lit, size_t size)
+{
+	char run[size];
+	size_t n = 0, best = 0;
+	int depth = 0;
+	const char *p;
+
+	lit[0] = '\0';
+	for(p=re; *p; p++) {
+		char c = *p;
+		int plain = 0;
+		switch(c) {
+		case '\\':
+			if(p[1] && ispunct((unsigned char)p[1])) c = *++p, plain = depth == 0;
+			else if(p[1]) p++;
+			break;
+		case '(': depth++; break;
+		case ')': if(depth) depth--; break;
+		case '|': lit[0] = '\0'; return;
+		case '[':
+			if(p[1] == '^') p++;
+			if(p[1] == ']') p++;
+			while(p[1] && p[1] != ']') p++;
+			if(p[1]) p++;
+			break;
+		case '{':
+			while(p[1] && p[1] != '}') p++;
+			if(p[1]) p++;
+			/* fall through */
+		case '*': case '?':
+			if(n) n--; /* the previous character is optional */
+			break;
+		case '.': case '^': case '$': case '+':
+			break;
+		default:
+			plain = depth == 0;
+		}
+
+		if(plain && n+1 < size) {
+			run[n++] = c;
+			continue;
+		}
+		if(n > best) {
+			memcpy(lit, run, n);
+			lit[n] = '\0';
+			best = n;
+		}
+		n = 0;
+	}
+	if(n > best) {
+		memcpy(lit, run, n);
+		lit[n] = '\0';
+	}
+}
+
+/* Entry ids whose names contain every trigram of lit (case folded), in
+   ascending order; NULL with *n = 0 if some trigram is absent. */
+static uint32_t *trigram_candidates(const char *lit, size_t *n)
+{
+	size_t len = strlen(lit), k;
+	uint32_t *cand = NULL;
+	*n = 0;
+
+	for(k=0; k+3<=len; k++) {
+		uint32_t tri = trigram(&lit[k]);
+		size_t lo = 0, hi = g_hdr->ntri;
+		while(lo < hi) {
+			size_t mid = (lo+hi)/2;
+			if(g_tri[mid].tri < tri) lo = mid+1;
+			else hi = mid;
+		}
+		if(lo == g_hdr->ntri || g_tri[lo].tri != tri) { free(cand); *n = 0; return NULL; }
+
+		const uint32_t *post = &g_post[g_tri[lo].first];
+		size_t npost = g_tri[lo+1].first - g_tri[lo].first;
+		if(!cand) {
+			cand = malloc(npost*sizeof(uint32_t));
+			if(!cand) { eprintf(ERR, "malloc() failed:"); exit(1); }
+			memcpy(cand, post, npost*sizeof(uint32_t));
+			*n = npost;
+			continue;
+		}
+
+		size_t i=0, j=0, m=0;
+		while(i<*n && j<npost) {
+			if(cand[i] < post[j]) i++;
+			else if(cand[i] > post[j]) j++;
+			else cand[m++] = cand[i++], j++;
+		}
+		*n = m;
+		if(!m) { free(cand); return NULL; }
+	}
+	return cand;
+}
+
+static const struct index_ent *index_find(uint64_t ino)
+{
+	size_t lo = 0, hi = g_hdr->nentries;
+	while(lo < hi) {
+		size_t mid = (lo+hi)/2;
+		if(g_ent[mid].ino < ino) lo = mid+1;
+		else hi = mid;
+	}
+	return lo < g_hdr->nentries && g_ent[lo].ino == ino ? &g_ent[lo] : NULL;
+}
+
+/* "/a/b/name" when the chain reaches the root directory, "<0x83>/b/name"
+   when it stops at a directory whose own entry wasn't found. Names go
+   through putname if set, raw otherwise. */
+static void print_path(FILE *out, const struct index_ent *e, void (*putname)(FILE *out, const char *name))
+{
+	const struct index_ent *chain[INDEX_MAXDEPTH];
+	unsigned depth = 0;
+	uint64_t top;
+
+	chain[depth++] = e;
+	for(top = e->parent; top != g_hdr->rootino && depth < INDEX_MAXDEPTH; ) {
+		const struct index_ent *p = index_find(top);
+		if(!p) break;
+		chain[depth++] = p;
+		top = p->parent;
+	}
+
+	fprintf(out, "0x%llx\t", (unsigned long long)e->ino);
+	if(top != g_hdr->rootino) fprintf(out, "<0x%llx>", (unsigned long long)top);
+	while(depth--) {
+		fputc('/', out);
+		if(putname) putname(out, &g_name[chain[depth]->nameoff]);
+		else fputs(&g_name[chain[depth]->nameoff], out);
+	}
+	fprintf(out, "\n");
+}
+
+/* Prints "ino<TAB>path" to out for every name matching query; see
+   print_path() for putname. */
+int index_search(FILE *out, const char *query, int isregex, int icase, void (*putname)(FILE *out, const char *name))
+{
+	regex_t re;
+	char lit[256];
+	if(isregex) {
+		if(regcomp(&re, query, REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0))) {
+			eprintf(ERR, "Bad regex: %s", query);
+			return -1;
+		}
+		regex_literal(query, lit, sizeof(lit));
+	} else {
+		if(strlen(query) >= sizeof(lit)) return 0; /* longer than any name */
+		strcpy(lit, query);
+	}
+	size_t litlen = strlen(lit);
+
+	size_t ncand = g_hdr->nentries, i, nmatch = 0;
+	uint32_t *cand = NULL;
+	if(litlen >= 3) {
+		cand = trigram_candidates(lit, &ncand);
+		eprintf(INFO, "Literal \"%s\": %zu candidates", lit, ncand);
+	}
+
+	for(i=0; i<ncand; i++) {
+		const struct index_ent *e = &g_ent[cand ? cand[i] : i];
+		const char *name = &g_name[e->nameoff];
+		if(litlen && !(icase ? strcasestr(name, lit) : memmem(name, e->namelen, lit, litlen)))
+			continue;
+		if(isregex && regexec(&re, name, 0, NULL, 0)) continue;
+		print_path(out, e, putname);
+		nmatch++;
+	}
+
+	eprintf(INFO, "%zu matches", nmatch);
+	free(cand);
+	if(isregex) regfree(&re);
+	return 0;
+}
+
+#ifdef BUILDPROGINDEX
+static const char *g_progname = "xfsr-index";
+
+/* Building */
+
+static struct index_ent *g_ents;
+static size_t g_nents, g_entcap;
+static char *g_names;
+static size_t g_namesize, g_namecap;
+
+static int index_add(uint64_t ino, uint64_t parent, const char *name)
+{
+	size_t len = strlen(name);
+	if(g_nents == g_entcap) {
+		size_t cap = g_entcap ? 2*g_entcap : 4096;
+		struct index_ent *e = realloc(g_ents, cap*sizeof(*e));
+		if(!e) { eprintf(ERR, "realloc() failed:"); return -1; }
+		g_ents = e;
+		g_entcap = cap;
+	}
+	if(g_namesize + len + 1 > g_namecap) {
+		size_t cap = g_namecap ? 2*g_namecap : 1<<16;
+		while(cap < g_namesize + len + 1) cap *= 2;
+		char *p = realloc(g_names, cap);
+		if(!p) { eprintf(ERR, "realloc() failed:"); return -1; }
+		g_names = p;
+		g_namecap = cap;
+	}
+	if(g_namesize + len + 1 > UINT32_MAX) { eprintf(ERR, "Name table full"); return -1; }
+
+	memcpy(&g_names[g_namesize], name, len + 1);
+	g_ents[g_nents].ino = ino;
+	g_ents[g_nents].parent = parent;
+	g_ents[g_nents].nameoff = g_namesize;
+	g_ents[g_nents].namelen = len;
+	g_nents++;
+	g_namesize += len + 1;
+	return 0;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static int ent_cmp(const void *a, const void *b)
+{
+	const struct index_ent *x = a, *y = b;
+	if(x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+	return x->parent < y->parent ? -1 : x->parent > y->parent;
+}
+
+static int index_write(const char *path)
+{
+	/* (trigram << 32 | entry) pairs, sorted: the postings come out grouped
+	   by trigram and sorted by entry, duplicates adjacent. */
+	size_t npairs = 0, i, cap = 0;
+	uint64_t *pairs = NULL;
+	for(i=0; i<g_nents; i++) {
+		const char *name = &g_names[g_ents[i].nameoff];
+		unsigned k, len = g_ents[i].namelen;
+		if(len < 3) continue;
+		if(npairs + len > cap) {
+			cap = cap ? 2*cap : 1<<16;
+			while(cap < npairs + len) cap *= 2;
+			uint64_t *p = realloc(pairs, cap*sizeof(uint64_t));
+			if(!p) { eprintf(ERR, "realloc() failed:"); free(pairs); return -1; }
+			pairs = p;
+		}
+		for(k=0; k+3<=len; k++)
+			pairs[npairs++] = (uint64_t)trigram(&name[k]) << 32 | i;
+	}
+	qsort(pairs, npairs, sizeof(uint64_t), u64_cmp);
+
+	size_t ntri = 0, npost = 0;
+	struct index_tri *tris = malloc((npairs+1)*sizeof(*tris));
+	uint32_t *posts = malloc((npairs+1)*sizeof(uint32_t));
+	if(!tris || !posts) { eprintf(ERR, "malloc() failed:"); free(pairs); free(tris); free(posts); return -1; }
+	for(i=0; i<npairs; i++) {
+		if(i && pairs[i] == pairs[i-1]) continue;
+		uint32_t tri = pairs[i] >> 32;
+		if(!ntri || tris[ntri-1].tri != tri) {
+			tris[ntri].tri = tri;
+			tris[ntri++].first = npost;
+		}
+		posts[npost++] = (uint32_t)pairs[i];
+	}
+	tris[ntri].tri = UINT32_MAX;
+	tris[ntri].first = npost;
+	free(pairs);
+
+	struct index_hdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, INDEX_MAGIC, 8);
+	hdr.rootino = GET64(g_sb.sb_rootino);
+	hdr.nentries = g_nents;
+	hdr.ntri = ntri;
+	hdr.npost = npost;
+	hdr.namesize = g_namesize;
+
+	FILE *fp = fopen(path, "w");
+	if(!fp) { eprintf(ERR, "Failed to open %s:", path); free(tris); free(posts); return -1; }
+	int err = 0;
+	if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	   fwrite(g_ents, sizeof(*g_ents), g_nents, fp) != g_nents ||
+	   fwrite(tris, sizeof(*tris), ntri+1, fp) != ntri+1 ||
+	   fwrite(posts, sizeof(*posts), npost, fp) != npost ||
+	   fwrite(g_names, 1, g_namesize, fp) != g_namesize)
+		err = -1;
+	if(fclose(fp)) err = -1;
+	if(err) eprintf(ERR, "Failed to write %s:", path);
+
+	eprintf(INFO, "%zu entries, %zu trigrams, %zu postings, %zu bytes of names",
+		g_nents, ntri, npost, g_namesize);
+	free(tris);
+	free(posts);
+	return err;
+}
+
+static int index_build(FILE *devfp, const char *listfile, const char *outfile)
+{
+	uint64_t *dirs;
+	int ndirs = read_iadr_list(listfile, &dirs);
+	if(ndirs < 0) return -1;
+	qsort(dirs, ndirs, sizeof(uint64_t), u64_cmp);
+
+	dirlist_t dl;
+	memset(&dl, 0, sizeof(dl));
+	int i, nok = 0;
+	for(i=0; i<ndirs; i++) {
+		xfs_dinode_t dinode;
+		if(i && dirs[i] == dirs[i-1]) continue;
+		if(read_inode(devfp, &dinode, dirs[i]) < 0 || !dinode_isdir(&dinode)) {
+			eprintf(WARN, "Not a directory: iadr=0x%llx", dirs[i]);
+			continue;
+		}
+
+		dl.n = dl.namesize = 0;
+		if(dir_collect(devfp, dirs[i], &dinode, &dl) < 0) {
+			eprintf(WARN, "Failed to read directory at iadr=0x%llx", dirs[i]);
+			continue;
+		}
+
+		uint64_t ino = iadr_to_ino(dirs[i]);
+		size_t k;
+		for(k=0; k<dl.n; k++) {
+			const char *name = &dl.names[dl.nameoff[k]];
+			if(!strcmp(name, ".") || !strcmp(name, "..")) continue;
+			if(index_add(dl.ino[k], ino, name) < 0) exit(1);
+		}
+		nok++;
+	}
+	dirlist_free(&dl);
+	free(dirs);
+	eprintf(INFO, "%d directories indexed", nok);
+
+	qsort(g_ents, g_nents, sizeof(*g_ents), ent_cmp);
+	return index_write(outfile);
+}
+
+void usage()
+{
+	printf("Build or search a filename index\n");
+	printf("usage: %s [-v -M -L logfile] -I dirlist -o indexfile devfile\n", g_progname);
+	printf("       %s [-v -i] (-s substring | -r regex) indexfile\n", g_progname);
+	printf("dirlist holds directory iadrs as printed by xfsr-dirfind (\"-\" for stdin).\n");
+	printf("Regexes are POSIX extended; -i ignores case. Matches print as ino<TAB>path.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c, icase = 0, isregex = 0;
+	char *listfile = NULL, *outfile = NULL, *query = NULL;
+	setlocale(LC_ALL, "");
+
+	while( (c=getopt(argc,argv,"vML:I:o:s:r:i")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 'I':
+			listfile = optarg;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 's':
+			query = optarg;
+			isregex = 0;
+			break;
+		case 'r':
+			query = optarg;
+			isregex = 1;
+			break;
+		case 'i':
+			icase = 1;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind>=argc || !(query || (listfile && outfile))) {
+		usage();
+		exit(0);
+	}
+
+	if(query) {
+		if(index_open(argv[optind]) < 0) exit(1);
+		return -index_search(stdout, query, isregex, icase, NULL);
+	}
+
+	FILE *devfp = dev_open(argv[optind]);
+	if(!devfp) { perror(strerror(errno)); exit(errno); }
+
+	if(read_sb(devfp) <0) {
+		eprintf(ERR, "Not a valid superblock");
+		exit(2);
+	}
+
+	return -index_build(devfp, listfile, outfile);
+}
+#endif
@@ -26,16 +26,74 @@
 
 
 void set_dump_opts(int preserve);
+void set_dump_jobs(int n);
+void set_dump_manifest(FILE *fp);
+void set_dump_prefix(const char *prefix);
+int set_dump_journal(const char *path);
+int dump_dir_done(const char *dir, uint64_t ino);
+void dump_dir_finish(const char *dir, uint64_t ino);
 int dump(FILE *devfp, const char *outfile, uint64_t iadr);
+int dump_tar(FILE *devfp, FILE *tarfp, const char *name, uint64_t iadr);
 void restore_stats(const char *outfile, xfs_dinode_t *dinode);
 int ls(FILE *fp, uint64_t iadr);
 
 static int g_dump=0, g_recurse=0, g_recurse_cur=0,g_preserve=0, g_incasesensitive;
 static int show_hidden = 1, minimal_list=0;
 static const char *g_progname = "xfsr-ls";
-static FILE *g_outfp;
+static FILE *g_outfp, *g_tarfp;
 static char *g_pattern;
 static regex_t compiled;
+static char g_path[PATH_MAX]; /* dump dir relative to -D, for the manifest */
+static char g_root[PATH_MAX]; /* the -D dir itself */
+static unsigned g_failed; /* failed dumps and subtrees cut off by -R, so far */
+
+/* Inodes met so far: directories, to stop at loops, and dumped files, so
+   that later entries of the same inode become hard links to the first. */
+static inotab_t g_dirs; /* set */
+static inotab_t g_files; /* ino -> offset of its first path in g_filepaths */
+static char *g_filepaths;
+static size_t g_filepathsize, g_filepathcap;
+
+/* Path of the first dump of ino, relative to the dump root, or NULL if
+   there is none yet. */
+static const char *first_path(uint64_t ino)
+{
+	uint64_t *off = inotab_get(&g_files, ino);
+	return off ? &g_filepaths[*off] : NULL;
+}
+
+/* Records name as the first dump of ino, once it has been dumped. */
+static void first_path_add(uint64_t ino, const char *name)
+{
+	size_t len = strlen(g_path) + strlen(name) + 1;
+	if(g_filepathsize + len > g_filepathcap) {
+		size_t cap = g_filepathcap ? 2*g_filepathcap : 1<<16;
+		while(cap < g_filepathsize + len) cap *= 2;
+		char *p = realloc(g_filepaths, cap);
+		if(!p) { eprintf(ERR, "realloc() failed:"); return; }
+		g_filepaths = p;
+		g_filepathcap = cap;
+	}
+	uint64_t *off = inotab_put(&g_files, ino);
+	if(!off) return;
+	*off = g_filepathsize;
+	snprintf(&g_filepaths[g_filepathsize], len, "%s%s", g_path, name);
+	g_filepathsize += len;
+}
+
+static int link_first(const char *first, const char *name)
+{
+	char path[PATH_MAX];
+	if(snprintf(path, sizeof(path), "%s/%s", g_root, first) >= (int)sizeof(path)) {
+		eprintf(WARN, "Path of %s too long to link, dumping again", first);
+		return -1;
+	}
+	if(link(path, name) == 0) return 0;
+	/* A rerun finds the links of the last one */
+	if(errno == EEXIST && unlink(name) == 0 && link(path, name) == 0) return 0;
+	eprintf(WARN, "link(%s, %s) failed, dumping again:", path, name);
+	return -1;
+}
 
 void print_entry(FILE *devfp, uint64_t ino, xfs_dinode_t *dinode, const char *name)
 {
@@ -57,204 +115,97 @@ void print_entry(FILE *devfp, uint64_t ino, xfs_dinode_t *dinode, const char *na
 	}
 
 	if(g_recurse > g_recurse_cur && S_ISDIR(mode) && strcmp(name, ".") && strcmp(name, "..") ) {
-
-		if(g_dump) {
-			if(mkdir(name,mode)) { eprintf(ERR, "mkdir() failed:"); return; }
+		if(inotab_get(&g_dirs, ino)) {
+			eprintf(WARN, "Directory %s%s (ino=0x%llx) was seen before: a loop or a repeated subtree, skipping",
+				g_path, name, ino);
+			return;
+		}
+		if(!inotab_put(&g_dirs, ino)) return;
+
+		size_t pathlen = strlen(g_path);
+		if(g_tarfp) {
+			snprintf(g_path + pathlen, sizeof(g_path) - pathlen, "%s/", name);
+			tar_header(g_tarfp, g_path, dinode, '5', 0, NULL, NULL);
+		} else if(g_dump) {
+			if(dump_dir_done(name, ino)) {
+				eprintf(INFO, "%s%s was dumped before, skipping", g_path, name);
+				return;
+			}
+			/* It exists if an earlier run got this far */
+			if(mkdir(name,mode) && errno != EEXIST) { eprintf(ERR, "mkdir() failed:"); g_failed++; return; }
 			if(g_preserve) restore_stats(name,dinode);
-			if(chdir(name)) { eprintf(ERR, "chdir() failed:"); return; }
+			if(chdir(name)) { eprintf(ERR, "chdir() failed:"); g_failed++; return; }
+			snprintf(g_path + pathlen, sizeof(g_path) - pathlen, "%s/", name);
 		}
+		unsigned failed = g_failed;
 		g_recurse_cur++;
-		ls(devfp, iadr);
+		int err = ls(devfp, iadr);
 		g_recurse_cur--;
-		if(chdir("..")) { eprintf(ERR, "chdir() failed:"); return; }
+		g_path[pathlen] = '\0';
+		if(g_dump && chdir("..")) { eprintf(ERR, "chdir() failed:"); return; }
+		/* Only a subtree that is all there is journalled as done */
+		if(g_dump && !err && failed == g_failed) dump_dir_finish(name, ino);
+	} else if(S_ISDIR(mode)) {
+		if(strcmp(name, ".") && strcmp(name, "..")) g_failed++;
 	} else if(S_ISREG(mode) || S_ISLNK(mode)) {
-		if(g_dump && dump(devfp, name, iadr) != 0) eprintf(ERR, "Failed to dump %s", name);
-	}
-}
-
-static int ls_local(FILE *devfp, xfs_dinode_t *dinode, uint64_t g_iadr)
-{
-	off_t off = ftello(devfp);
-	seek_iadr(devfp, g_iadr);
-	unsigned inodesize = GET16(g_sb.sb_inodesize);
-	unsigned char inode[inodesize];
-	fread(inode,inodesize,1,devfp);
-	fseeko(devfp, off, SEEK_SET);
-	xfs_dir2_sf_hdr_t *dir2_hdr = (xfs_dir2_sf_hdr_t*)&inode[INO_DATA_FORK_OFFSET];
-	unsigned count=0, inolen=0;
-	if(dir2_hdr->count) count=dir2_hdr->count, inolen = 4;
-	else if(dir2_hdr->i8count) count=dir2_hdr->i8count, inolen = 8;
-	else { eprintf(ERR, "Corrupted local dir at iadr=0%Lx", g_iadr); return -1; }
-
-	unsigned char *p = &inode[INO_DATA_FORK_OFFSET] + 1+1;
-	unsigned i;
-
-	uint64_t parent_ino = inolen==4 ? GET32(*((uint32_t*)p)) : GET64(*((uint64_t*)p));
-	p+=inolen;
-
-	uint64_t g_ino = iadr_to_ino(g_iadr);
-
-	print_entry(devfp,g_ino,dinode,".");
-	xfs_dinode_t parent_dinode;
-	read_inode(devfp,&parent_dinode,ino_to_iadr(parent_ino));
-	print_entry(devfp,parent_ino,&parent_dinode,"..");
-
-	for(i=0; i<count; i++) {
-			uint8_t namelen = *p++;
-			//uint16_t offset = GET16(*((uint16_t*)p)); //FIXME: what the heck is this offset?
-			p+=2;
-			char name[namelen+1];
-			memcpy(name,p,namelen);
-			p+=namelen;
-			name[namelen] = '\0';
-			uint64_t ino;
-			ino = inolen==4 ? GET32P(p) : GET64P(p);
-			p+=inolen;
-			xfs_dinode_t einode;
-			if( read_inode(devfp,&einode,ino_to_iadr(ino)) ) {
-				eprintf(ERR, "Invalid local");
-			}
-			print_entry(devfp,ino,&einode,name);
-	}
-	return 0;
-}
-
-static int read_dir2_block(unsigned offset, char *blockp, char *name, uint64_t *inop)
-{
-	uint64_t *blockp64 = (uint64_t*)blockp;
-	uint8_t *ublockp = (uint8_t*)blockp;
-	*inop = GET64(*blockp64);
-
-	unsigned len;
-	unsigned size;
-	unsigned tag;
-	if(*inop>>48 == 0xffff) {
-		len = (*inop>>32) & 0xffff;
-		size = len;
-		tag = blockp[size-2];
-	} else {
-		len = ublockp[8];
-		memcpy(name, &ublockp[9], len);
-		name[len] = '\0';
-
-		size=8+1+len+2; // 8 for inode adr, 1 for strlen, len for name, 2 for tag
-		unsigned size_raw = size;
-		if(size&7) size += 8-(size&7); // align to 8-bytes boundary
-
-	}
-
-	tag = (((unsigned)ublockp[size-2])<<8) + ublockp[size-1];
-
-	if(offset != tag && len != 0) {
-		eprintf(WARN,"Block dir tag doesn't match the offset (tag=0x%x,offset=0x%x,size=0x%x)\n",
-			tag, offset, size);
+		const char *first = (g_tarfp || g_dump) && S_ISREG(mode) ? first_path(ino) : NULL;
+		if(g_tarfp) {
+			if(first) {
+				char path[PATH_MAX];
+				snprintf(path, sizeof(path), "%s%s", g_path, name);
+				tar_header(g_tarfp, path, dinode, '1', 0, first, NULL);
+			} else if(dump_tar(devfp, g_tarfp, name, iadr) != 0) eprintf(ERR, "Failed to dump %s", name);
+			else if(S_ISREG(mode)) first_path_add(ino, name);
+		} else if(g_dump && (!first || link_first(first, name) < 0)) {
+			/* Only a complete dump is worth linking to */
+			if(dump(devfp, name, iadr) != 0) {
+				eprintf(ERR, "Failed to dump %s", name);
+				g_failed++;
+			} else if(S_ISREG(mode) && !first) first_path_add(ino, name);
+		}
 	}
-	return tag==0 || len == 0 ? 0 :size;
-
 }
 
-static int ls_extents_handle_extent(unsigned nblocks, FILE *fp, xfs_bmbt_irec_t *irec, uint64_t g_iadr)
+/* Fetches the inodes of all collected entries and prints them in directory
+   order. Returns the number of entries printed. */
+static int dirlist_emit(FILE *devfp, dirlist_t *dl)
 {
-	eprintf(INFO, "Begin extent block (blkadr=0x%llx, blkno=0x%llx)",
-		blkno_to_blkadr(irec->br_startblock), irec->br_startblock);
-
-	seek_blkno(fp, irec->br_startblock);
-
-	if(irec->br_startoff == 1LL<<(35-g_sb.sb_blocklog)) {
-		eprintf(WARN, "Extent dirs' leaves are not handled");
-		return 0;
-	}
-
-	// Verify magic
-	uint32_t magic;
-	fread(&magic, 4, 1, fp);
-	magic = GET32(magic);
-	if(magic != (nblocks==1 ? XFS_DIR2_BLOCK_MAGIC : XFS_DIR2_DATA_MAGIC) ) {
-		eprintf(ERR, "Dir block magic failed: 0x%x", magic);
+	if(dl->n == 0) return 0;
+
+	uint64_t *iadrs = malloc(dl->n*sizeof(uint64_t));
+	xfs_dinode_t *dinodes = malloc(dl->n*sizeof(xfs_dinode_t));
+	char *ok = malloc(dl->n);
+	if(!iadrs || !dinodes || !ok) {
+		eprintf(ERR, "malloc() failed:");
+		free(iadrs); free(dinodes); free(ok);
 		return -1;
 	}
 
-	uint32_t blocksize = GET32(g_sb.sb_blocksize);
-	// Read rest of the block
-	char block[blocksize];
-	fread(&block[4],blocksize-4,1,fp);
-
-	// Read & print out entries
-	char name[255+1];
-	char *p = &block[0x10];
-	uint64_t ino;
-	unsigned nentries=0;
-
-	do {
-		int size = read_dir2_block((unsigned long)p - (unsigned long)block, p,name, &ino);
-		if(size == 0) break;
-		p += size;
+	size_t i;
+	for(i=0; i<dl->n; i++)
+		iadrs[i] = ino_to_iadr(dl->ino[i]);
+	int nok = read_inodes(devfp, iadrs, dl->n, dinodes, ok);
 
-		if(p>=&block[blocksize]) // end of block
-			break;
-
-		if( (ino>>48)==0xffff ) // unlinked entry
+	for(i=0; nok >= 0 && i<dl->n; i++) {
+		const char *name = &dl->names[dl->nameoff[i]];
+		if(!ok[i]) {
+			eprintf(ERR, "Invalid inode for %s (ino=0x%llx)", name, dl->ino[i]);
 			continue;
-
-		uint64_t iadr = ino_to_iadr(ino);
-
-		xfs_dinode_t dinode;
-		if(!read_inode(fp,&dinode,iadr)) {
-			print_entry(fp,ino,&dinode,name);
-
-			if(nentries == 0 && !strcmp(".", name) && iadr != g_iadr) {
-				eprintf(ERR,"Entry . doesnt point to itself (g_iadr=0x%llx)", iadr);
-				return -2;
-			}
-			nentries++;
 		}
-	} while(p<&block[blocksize]);
-
-	return (int)nentries;
-}
-
-
-static int ls_extents(FILE *fp, xfs_dinode_t *dinode, uint64_t g_iadr)
-{
-	unsigned nextents = GET32(dinode->di_core.di_nextents);
-	off_t off = ftello(fp);
-
-	seek_iadr(fp, g_iadr);
-	fseek(fp, INO_DATA_FORK_OFFSET, SEEK_CUR);
-
-	xfs_bmbt_rec_64_t rec[nextents];
-	fread(rec, sizeof(xfs_bmbt_rec_64_t), nextents, fp);
-	fseeko(fp, off, SEEK_SET);
-
-	unsigned nentries = 0, i;
-	for(i=0; i<nextents; i++) {
-		xfs_bmbt_irec_t irec;
-		xfs_bmbt_disk_get_all(&rec[i] , &irec);
-		int count = ls_extents_handle_extent(nextents,fp,&irec,g_iadr);
-		if(count < 0) return -1;
-		nentries += (unsigned)count;
-	}
-
-	if(nentries <2 ) {
-		eprintf(ERR,"A directory must have at least 2 entries");
-		return -1;
+		print_entry(devfp, dl->ino[i], &dinodes[i], name);
 	}
 
-	eprintf(INFO, "%u entries in total.", nentries);
-	return 0;
-}
-
-static int ls_btree(FILE *fp, xfs_dinode_t *dinode)
-{
-	eprintf(ERR, "B+ tree directories are not handled yet.");
-	return -80;
+	free(iadrs);
+	free(dinodes);
+	free(ok);
+	return nok;
 }
 
 int ls(FILE *fp, uint64_t iadr)
 {
 	xfs_dinode_t dinode;
 
-	eprintf(INFO, "Reading inode at iadr=0x%llx", iadr);
+	TRACE("ls: reading inode at iadr=0x%llx", iadr);
 
 	uint64_t g_ino = iadr_to_ino(iadr);
 
@@ -272,26 +223,11 @@ int ls(FILE *fp, uint64_t iadr)
 	eprintf(INFO, "Listing entries");
 	eprintf(INFO, "\tiadr\t\tino\t\tsize\t\tmode\tuid\tgid\tname");
 
-	int err;
-
-	switch(dinode.di_core.di_format)
-	{
-		case XFS_DINODE_FMT_LOCAL:
-			err = ls_local(fp,&dinode,iadr);
-		break;
-
-		case XFS_DINODE_FMT_EXTENTS:
-			err = ls_extents(fp,&dinode,iadr);
-		break;
-
-		case XFS_DINODE_FMT_BTREE:
-			err = ls_btree(fp,&dinode);
-		break;
-
-		default:
-			eprintf(ERR, "Unknown/unhandled dir format");
-			exit(1);
-	}
+	dirlist_t dl;
+	memset(&dl, 0, sizeof(dl));
+	int err = dir_collect(fp, iadr, &dinode, &dl);
+	if(!err && dirlist_emit(fp, &dl) < 0) err = -1;
+	dirlist_free(&dl);
 
 	return -err;
 }
@@ -300,7 +236,7 @@ int ls(FILE *fp, uint64_t iadr)
 void usage()
 {
 	printf("List a directory at a given ino/iadr\n");
-	printf("usage: %s [-v -H -m -L logfile -p -D dumpdir -R recurselevel] (-A iadr | -N ino) devfile\n", g_progname);
+	printf("usage: %s [-v -H -m -M -L logfile -C manifest -r journal -j jobs -p (-D dumpdir | -T tarfile) -R recurselevel] (-A iadr | -N ino) devfile\n", g_progname);
 }
 
 int main(int argc, char *argv[])
@@ -309,8 +245,9 @@ int main(int argc, char *argv[])
 	char *devfile = NULL;
 	setlocale(LC_ALL, "");
 	uint64_t g_iadr=0, g_ino=0;
+	FILE *manifest;
 
-	while( (c=getopt(argc,argv,"R:D:vmHN:A:L:pP:")) != EOF ) {
+	while( (c=getopt(argc,argv,"R:D:vmHN:A:L:pP:MC:T:j:r:")) != EOF ) {
 
 		switch(c) {
 		case 'N':
@@ -348,6 +285,25 @@ int main(int argc, char *argv[])
 		case 'i':
 			g_incasesensitive = 1;
 			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'C':
+			if(!(manifest = fopen(optarg, "a"))) { perror(strerror(errno)); exit(errno); }
+			set_dump_manifest(manifest);
+			break;
+		case 'j':
+			set_dump_jobs(atoi(optarg));
+			break;
+		case 'r':
+			if(set_dump_journal(optarg) < 0) exit(1);
+			break;
+		case 'T':
+			/* The tar stream may be stdout, so the listing moves to stderr */
+			g_outfp = stderr;
+			g_tarfp = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+			if(!g_tarfp) { perror(strerror(errno)); exit(errno); }
+			break;
 		default:
 			usage();
 			exit(0);
@@ -361,7 +317,7 @@ int main(int argc, char *argv[])
 
 	devfile = argv[optind];
 
-	FILE *fp = fopen(devfile, "r");
+	FILE *fp = dev_open(devfile);
 	if(!fp) { perror(strerror(errno)); exit(errno); }
 
 	if(read_sb(fp) <0) {
@@ -378,9 +334,15 @@ int main(int argc, char *argv[])
 		exit(2);
 	}
 
+	set_dump_prefix(g_path);
+	inotab_init(&g_dirs, 0);
+	inotab_init(&g_files, sizeof(uint64_t));
+	inotab_put(&g_dirs, g_ino);
+	if(g_dump && !getcwd(g_root, sizeof(g_root))) { eprintf(ERR, "getcwd() failed:"); exit(1); }
 	if(g_pattern) regcomp(&compiled, g_pattern, REG_NOSUB | (g_incasesensitive ? REG_ICASE : 0));
 
 	int err = ls(fp, g_iadr);
+	if(g_tarfp) tar_end(g_tarfp);
 	if(err) eprintf(ERR, "Failure");
 	return -err;
 }
@@ -0,0 +1,233 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Metadata image. Collects the metadata blocks in a bitmap: AG headers and
+   btrees, inode chunks, and for every inode its bmbt blocks and, for
+   directories and symlinks, its data. With a census map, every block it
+   typed as metadata is added too, which finds what the btrees lost. The
+   blocks are then copied, in disk order, to a sparse file of the size of
+   the filesystem, at their own offsets; the xfsr tools run on it as they
+   do on the device, just without file data. */
+
+#include "xfsr.h"
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define METADUMP_CHUNK (1<<20)
+
+static const char *g_progname = "xfsr-metadump";
+static bitmap_t g_copy;
+static uint64_t *g_iadrs;
+static size_t g_niadrs, g_capiadrs;
+
+static void mark(uint64_t blkadr, uint64_t len)
+{
+	if(blkadr >= g_copy.nblocks) return;
+	if(len > g_copy.nblocks - blkadr) len = g_copy.nblocks - blkadr;
+	if(bitmap_set_range(&g_copy, blkadr, len, NULL) < 0) exit(1);
+}
+
+static void add_iadr(uint64_t iadr)
+{
+	if(g_niadrs == g_capiadrs) {
+		size_t cap = g_capiadrs ? 2*g_capiadrs : 4096;
+		uint64_t *p = realloc(g_iadrs, cap*sizeof(uint64_t));
+		if(!p) { eprintf(ERR, "realloc() failed:"); exit(1); }
+		g_iadrs = p;
+		g_capiadrs = cap;
+	}
+	g_iadrs[g_niadrs++] = iadr;
+}
+
+/* Everything but data, zeros and what the census couldn't read; the inodes
+   it found are followed like those of the inobt. */
+static void census_meta(const uint8_t *census, uint64_t nblocks)
+{
+	uint64_t b;
+	unsigned i, n = GET16(g_sb.sb_inopblock);
+	for(b=0; b<nblocks; b++) {
+		unsigned t = census[b] & ~BT_BAD;
+		if(t != BT_UNSCANNED && t != BT_UNREADABLE && t != BT_ZERO && t != BT_DATA)
+			mark(b, 1);
+		if(t == BT_INODES)
+			for(i=0; i<n; i++) add_iadr((b << g_sb.sb_inopblog) + i);
+	}
+}
+
+/* Directory and symlink blocks, and the bmbt blocks of every inode */
+static void inode_meta(FILE *fp)
+{
+	size_t batch = INODE_BATCH_MAX, i, k, j;
+	xfs_dinode_t *dinodes = malloc(batch*sizeof(xfs_dinode_t));
+	char *ok = malloc(batch);
+	extmap_t map;
+	if(!dinodes || !ok) { eprintf(ERR, "malloc() failed:"); exit(1); }
+	extmap_init(&map);
+
+	for(i=0; i<g_niadrs; i+=batch) {
+		size_t n = g_niadrs - i < batch ? g_niadrs - i : batch;
+		if(read_inodes(fp, &g_iadrs[i], n, dinodes, ok) < 0) exit(1);
+		for(k=0; k<n; k++) {
+			xfs_dinode_t *d = &dinodes[k];
+			int fmt = d->di_core.di_format;
+			uint16_t mode = GET16(d->di_core.di_mode);
+			if(!ok[k] || !mode) continue;
+			if(fmt != XFS_DINODE_FMT_EXTENTS && fmt != XFS_DINODE_FMT_BTREE) continue;
+			if(extmap_load(fp, g_iadrs[i+k], d, &map) < 0) continue;
+
+			for(j=0; j<map.nbmblk; j++)
+				mark(blkno_to_blkadr(map.bmblk[j]), 1);
+			if(S_ISDIR(mode) || S_ISLNK(mode))
+				for(j=0; j<map.n; j++)
+					mark(blkno_to_blkadr(map.startblock[j]), map.count[j]);
+		}
+	}
+
+	extmap_free(&map);
+	free(dinodes);
+	free(ok);
+}
+
+/* Copies the marked blocks. Returns the number of blocks that couldn't be
+   read; they stay holes. */
+static uint64_t copy_blocks(FILE *fp, int outfd)
+{
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	uint64_t perchunk = METADUMP_CHUNK / blocksize, b = 0, lost = 0;
+	unsigned char *buf = malloc(METADUMP_CHUNK);
+	if(!buf) { eprintf(ERR, "malloc() failed:"); exit(1); }
+	dev_advise(DEV_SEQUENTIAL);
+
+	while((b = bitmap_next(&g_copy, b, 1)) < g_copy.nblocks) {
+		uint64_t end = bitmap_next(&g_copy, b, 0);
+		while(b < end) {
+			uint64_t n = end - b < perchunk ? end - b : perchunk, k;
+			const unsigned char *p = dev_get(fp, b << g_sb.sb_blocklog, n*blocksize, buf);
+			for(k=0; k<n; k++) {
+				const unsigned char *blk = p ? p + k*blocksize :
+					dev_get(fp, (b+k) << g_sb.sb_blocklog, blocksize, buf);
+				if(!blk) {
+					eprintf(WARN, "Block 0x%llx is unreadable, leaving a hole", b+k);
+					lost++;
+					continue;
+				}
+				if(pwrite(outfd, blk, blocksize, (b+k) << g_sb.sb_blocklog) != (ssize_t)blocksize) {
+					eprintf(ERR, "Write to the image failed:");
+					exit(1);
+				}
+			}
+			b += n;
+		}
+	}
+	free(buf);
+	return lost;
+}
+
+void usage()
+{
+	printf("Copy the metadata of a filesystem into a sparse image, at the same offsets\n");
+	printf("usage: %s [-v -M -L logfile -c censusmap -l] -o imagefile devfile\n", g_progname);
+	printf("-c adds every block the census map typed as metadata, -l the log.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c, withlog = 0;
+	char *devfile = NULL, *outfile = NULL, *censusfile = NULL;
+
+	while( (c=getopt(argc,argv,"vML:c:lo:")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 'c':
+			censusfile = optarg;
+			break;
+		case 'l':
+			withlog = 1;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind>=argc || !outfile) {
+		usage();
+		exit(0);
+	}
+
+	devfile = argv[optind];
+
+	FILE *fp = dev_open(devfile);
+	if(!fp) { perror(strerror(errno)); exit(errno); }
+
+	if(read_sb(fp) <0) {
+		eprintf(ERR, "Not a valid superblock");
+		exit(2);
+	}
+	sb_print();
+
+	uint64_t nblocks = GET64(g_sb.sb_dblocks), ag;
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	if(bitmap_init(&g_copy, nblocks, blocksize) < 0) exit(1);
+
+	if(censusfile) {
+		uint64_t censusblocks;
+		const uint8_t *census = census_load(censusfile, 0, &censusblocks);
+		if(!census) exit(1);
+		census_meta(census, censusblocks < nblocks ? censusblocks : nblocks);
+	}
+
+	agwalk_t w = { mark, NULL, add_iadr, 0 };
+	for(ag=0; ag<GET32(g_sb.sb_agcount); ag++)
+		agwalk(fp, ag, &w);
+	if(w.bad) eprintf(WARN, "%llu damaged structures were skipped%s", w.bad, censusfile ? "" : " (try -c censusmap)");
+	eprintf(INFO, "%zu inodes to look at", g_niadrs);
+	inode_meta(fp);
+	if(withlog && GET64(g_sb.sb_logstart))
+		mark(blkno_to_blkadr(GET64(g_sb.sb_logstart)), GET32(g_sb.sb_logblocks));
+
+	int outfd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(outfd < 0) { eprintf(ERR, "Failed to create %s:", outfile); exit(1); }
+	if(ftruncate(outfd, nblocks * blocksize) < 0) { eprintf(ERR, "ftruncate() failed:"); exit(1); }
+
+	uint64_t ncopy = bitmap_count(&g_copy);
+	uint64_t lost = copy_blocks(fp, outfd);
+	if(close(outfd) < 0) { eprintf(ERR, "Write to the image failed:"); exit(1); }
+
+	printf("blocks\t%llu\n", (unsigned long long)nblocks);
+	printf("copied\t%llu\n", (unsigned long long)(ncopy - lost));
+	printf("unreadable\t%llu\n", (unsigned long long)lost);
+	return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Block ownership. Every allocated inode (from the inode btrees, or from a
+   census map when those are gone) has its extent map loaded and its blocks
+   set in the owned bitmap. Blocks claimed twice are cross-linked. Free
+   space comes from the bnobt; AG headers, the log, the AG btrees and the
+   inode chunks are metadata. What is neither free, metadata nor owned is
+   orphaned: a good place to look for lost data. Attribute forks are not
+   followed, so their blocks show up as orphans. */
+
+#include "xfsr.h"
+#include <string.h>
+#include <getopt.h>
+
+static const char *g_progname = "xfsr-owners";
+static bitmap_t g_owned, g_dup, g_free, g_meta;
+static const uint8_t *g_census;
+static uint64_t g_ninodes, g_ownedfree;
+
+static void mark(bitmap_t *bm, uint64_t blkadr, uint64_t len)
+{
+	if(bitmap_set_range(bm, blkadr, len, NULL) < 0) exit(1);
+}
+
+/* Inodes to look at, collected from the inobt */
+static uint64_t *g_iadrs;
+static size_t g_niadrs, g_capiadrs;
+
+static void add_iadr(uint64_t iadr)
+{
+	if(g_niadrs == g_capiadrs) {
+		size_t cap = g_capiadrs ? 2*g_capiadrs : 4096;
+		uint64_t *p = realloc(g_iadrs, cap*sizeof(uint64_t));
+		if(!p) { eprintf(ERR, "realloc() failed:"); exit(1); }
+		g_iadrs = p;
+		g_capiadrs = cap;
+	}
+	g_iadrs[g_niadrs++] = iadr;
+}
+
+static void mark_meta(uint64_t blkadr, uint64_t len)
+{
+	mark(&g_meta, blkadr, len);
+}
+
+static void mark_free(uint64_t blkadr, uint64_t len)
+{
+	mark(&g_free, blkadr, len);
+}
+
+/* Without inode btrees, every inode slot the census found */
+static void census_inodes(uint64_t nblocks)
+{
+	uint64_t b;
+	unsigned i, n = GET16(g_sb.sb_inopblock);
+	for(b=0; b<nblocks; b++) {
+		unsigned t = g_census[b] & ~BT_BAD;
+		if(t == BT_SB || t == BT_AGF || t == BT_AGI || t == BT_AGFL || t == BT_INOBT || t == BT_FINOBT ||
+				t == BT_BNOBT || t == BT_CNTBT || t == BT_RMAPBT || t == BT_REFCBT || t == BT_INODES)
+			mark(&g_meta, b, 1);
+		if(t == BT_INODES)
+			for(i=0; i<n; i++) add_iadr((b << g_sb.sb_inopblog) + i);
+	}
+}
+
+/* Sets the blocks of one extent; reports it if report is set and it
+   overlaps cross-linked blocks. */
+static void own(uint64_t ino, uint64_t blkadr, uint64_t len, int report)
+{
+	if(report) {
+		uint64_t n = bitmap_count_range(&g_dup, blkadr, len);
+		if(n) printf("conflict\t0x%llx\t0x%llx\t%llu\t%llu\n", (unsigned long long)ino, (unsigned long long)blkadr, (unsigned long long)len, (unsigned long long)n);
+		return;
+	}
+	if(bitmap_set_range(&g_owned, blkadr, len, &g_dup) < 0) exit(1);
+	g_ownedfree += bitmap_count_range(&g_free, blkadr, len);
+
+	/* Claimed by an inode and by the filesystem itself counts as a conflict too */
+	uint64_t end = blkadr + len, b = blkadr;
+	while((b = bitmap_next(&g_meta, b, 1)) < end) {
+		uint64_t e = bitmap_next(&g_meta, b, 0);
+		if(e > end) e = end;
+		mark(&g_dup, b, e - b);
+		b = e;
+	}
+}
+
+static void own_inodes(FILE *fp, int report)
+{
+	size_t batch = INODE_BATCH_MAX, i, k;
+	xfs_dinode_t *dinodes = malloc(batch*sizeof(xfs_dinode_t));
+	char *ok = malloc(batch);
+	extmap_t map;
+	if(!dinodes || !ok) { eprintf(ERR, "malloc() failed:"); exit(1); }
+	extmap_init(&map);
+
+	for(i=0; i<g_niadrs; i+=batch) {
+		size_t n = g_niadrs - i < batch ? g_niadrs - i : batch;
+		if(read_inodes(fp, &g_iadrs[i], n, dinodes, ok) < 0) exit(1);
+		for(k=0; k<n; k++) {
+			xfs_dinode_t *d = &dinodes[k];
+			int fmt = d->di_core.di_format;
+			if(!ok[k] || !GET16(d->di_core.di_mode)) continue;
+			if(!report) g_ninodes++;
+			if(fmt != XFS_DINODE_FMT_EXTENTS && fmt != XFS_DINODE_FMT_BTREE) continue;
+			if(extmap_load(fp, g_iadrs[i+k], d, &map) < 0) continue;
+
+			uint64_t ino = iadr_to_ino(g_iadrs[i+k]);
+			size_t j;
+			for(j=0; j<map.n; j++)
+				own(ino, blkno_to_blkadr(map.startblock[j]), map.count[j], report);
+			for(j=0; j<map.nbmblk; j++)
+				own(ino, blkno_to_blkadr(map.bmblk[j]), 1, report);
+		}
+	}
+
+	extmap_free(&map);
+	free(dinodes);
+	free(ok);
+}
+
+/* Blocks in none of free, meta and owned */
+static void orphans(bitmap_t *orphan)
+{
+	uint64_t nblocks = GET64(g_sb.sb_dblocks), b = 0;
+	for(;;) {
+		uint64_t s = b;
+		do {
+			b = s;
+			s = bitmap_next(&g_free, s, 0);
+			s = bitmap_next(&g_meta, s, 0);
+			s = bitmap_next(&g_owned, s, 0);
+		} while(s != b && s < nblocks);
+		if(s >= nblocks) break;
+
+		uint64_t e = bitmap_next(&g_free, s, 1), e2;
+		if((e2 = bitmap_next(&g_meta, s, 1)) < e) e = e2;
+		if((e2 = bitmap_next(&g_owned, s, 1)) < e) e = e2;
+		mark(orphan, s, e - s);
+		b = e;
+	}
+}
+
+void usage()
+{
+	printf("Find which blocks belong to which inodes, which are cross-linked and which are orphaned\n");
+	printf("usage: %s [-v -M -L logfile -c censusmap -o ownedmap -O orphanmap] devfile\n", g_progname);
+	printf("Inodes come from the inode btrees, or from the census map with -c.\n");
+	printf("Prints \"conflict<TAB>ino<TAB>blkadr<TAB>len<TAB>shared\" for extents with cross-linked blocks, then totals.\n");
+	printf("The maps can be given to xfsr-carve and xfsr-rawsearch as masks.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *devfile = NULL, *censusfile = NULL, *ownedfile = NULL, *orphanfile = NULL;
+
+	while( (c=getopt(argc,argv,"vML:c:o:O:")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 'c':
+			censusfile = optarg;
+			break;
+		case 'o':
+			ownedfile = optarg;
+			break;
+		case 'O':
+			orphanfile = optarg;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind>=argc) {
+		usage();
+		exit(0);
+	}
+
+	devfile = argv[optind];
+
+	FILE *fp = dev_open(devfile);
+	if(!fp) { perror(strerror(errno)); exit(errno); }
+
+	if(read_sb(fp) <0) {
+		eprintf(ERR, "Not a valid superblock");
+		exit(2);
+	}
+	sb_print();
+
+	uint64_t nblocks = GET64(g_sb.sb_dblocks), censusblocks, ag;
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	if(bitmap_init(&g_owned, nblocks, blocksize) < 0 || bitmap_init(&g_dup, nblocks, blocksize) < 0 ||
+			bitmap_init(&g_free, nblocks, blocksize) < 0 || bitmap_init(&g_meta, nblocks, blocksize) < 0)
+		exit(1);
+	if(censusfile) {
+		if(!(g_census = census_load(censusfile, 0, &censusblocks))) exit(1);
+		census_inodes(censusblocks < nblocks ? censusblocks : nblocks);
+	}
+
+	if(GET64(g_sb.sb_logstart))
+		mark(&g_meta, blkno_to_blkadr(GET64(g_sb.sb_logstart)), GET32(g_sb.sb_logblocks));
+	/* With a census the inodes are known already */
+	agwalk_t w = { mark_meta, mark_free, g_census ? NULL : add_iadr, 0 };
+	for(ag=0; ag<GET32(g_sb.sb_agcount); ag++)
+		agwalk(fp, ag, &w);
+	eprintf(INFO, "%zu inodes to look at", g_niadrs);
+
+	own_inodes(fp, 0);
+	uint64_t ndup = bitmap_count(&g_dup);
+	if(ndup) own_inodes(fp, 1);
+
+	bitmap_t orphan;
+	if(bitmap_init(&orphan, nblocks, blocksize) < 0) exit(1);
+	orphans(&orphan);
+
+	printf("blocks\t%llu\n", (unsigned long long)nblocks);
+	printf("free\t%llu\n", (unsigned long long)bitmap_count(&g_free));
+	printf("metadata\t%llu\n", (unsigned long long)bitmap_count(&g_meta));
+	printf("inodes\t%llu\n", (unsigned long long)g_ninodes);
+	printf("owned\t%llu\n", (unsigned long long)bitmap_count(&g_owned));
+	printf("cross-linked\t%llu\n", (unsigned long long)ndup);
+	printf("owned-but-free\t%llu\n", (unsigned long long)g_ownedfree);
+	printf("orphaned\t%llu\n", (unsigned long long)bitmap_count(&orphan));
+	if(w.bad) printf("damaged-structures\t%llu\n", (unsigned long long)w.bad);
+
+	if(ownedfile && bitmap_save(&g_owned, ownedfile) < 0) exit(1);
+	if(orphanfile && bitmap_save(&orphan, orphanfile) < 0) exit(1);
+	return 0;
+}
@@ -0,0 +1,406 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Geometry probe. Collects every superblock copy it can find: the primary,
+   then the backups at the start of each AG, located from the geometry of
+   any copy found so far, or, with none, by trying the AG sizes mkfs would
+   have picked for the device size. The geometry fields are put to a vote.
+   Separately, a few chunks of the device are scanned for inodes: the
+   distance between them gives the inode size, and a v3 inode outside AG 0
+   records its own number, which gives the AG size and so leads to the
+   backups. When no copy survives at all, the geometry is built from what
+   the inodes tell and mkfs defaults. The result is written as a geometry
+   file that the other tools take with "devfile,geom=file". */
+
+#include "xfsr.h"
+#include <string.h>
+#include <getopt.h>
+
+#define PROBE_MAXCOPIES 1024
+#define PROBE_MAXINODES 4096
+#define PROBE_CHUNK (64<<10)
+#define PROBE_AGSIZES 8
+
+struct sbcopy {
+	uint64_t off;
+	xfs_sb_t sb;
+	int crcok, ftype;
+};
+
+struct inohit {
+	uint64_t off, ino; /* ino only for v3 inodes, from di_ino */
+	int version;
+};
+
+static const char *g_progname = "xfsr-probe";
+static FILE *g_fp;
+static struct sbcopy g_copies[PROBE_MAXCOPIES];
+static unsigned g_ncopies;
+static struct inohit g_inodes[PROBE_MAXINODES];
+static unsigned g_ninodes;
+static uint64_t g_devsize, g_reads, g_maxreads = 4096;
+
+static int is_pow2(uint64_t v, uint64_t min, uint64_t max)
+{
+	return v >= min && v <= max && !(v & (v-1));
+}
+
+static unsigned ceil_log2(uint64_t v)
+{
+	unsigned l = 0;
+	while((1ULL << l) < v) l++;
+	return l;
+}
+
+static uint64_t agbytes_of(const xfs_sb_t *sb)
+{
+	return (uint64_t)GET32(sb->sb_agblocks) * GET32(sb->sb_blocksize);
+}
+
+/* Reads the sector at off and keeps it if it is a superblock that fits
+   where it was found. Returns 1 for a new copy. */
+static int try_sb(uint64_t off)
+{
+	unsigned char raw[4096];
+	unsigned i;
+	size_t len = g_devsize - off < sizeof(raw) ? g_devsize - off : sizeof(raw);
+
+	if(off >= g_devsize || g_reads >= g_maxreads || g_ncopies == PROBE_MAXCOPIES) return 0;
+	for(i=0; i<g_ncopies; i++)
+		if(g_copies[i].off == off) return 0;
+	g_reads++;
+	if(dev_read(g_fp, raw, len, off) < 0) return 0;
+
+	const xfs_sb_t *sb = (const xfs_sb_t *)raw;
+	uint64_t agbytes = agbytes_of(sb);
+	unsigned sectsize = GET16(sb->sb_sectsize);
+	if(GET32(sb->sb_magicnum) != XFS_SB_MAGIC) return 0;
+	if(!is_pow2(GET32(sb->sb_blocksize), 512, 65536) || !is_pow2(GET16(sb->sb_inodesize), 256, 2048) ||
+			!is_pow2(sectsize, 512, 32768) || !GET32(sb->sb_agcount) || !agbytes || !GET64(sb->sb_dblocks) ||
+			off % agbytes || off / agbytes >= GET32(sb->sb_agcount)) {
+		eprintf(WARN, "Superblock at 0x%llx doesn't fit its own geometry", off);
+		return 0;
+	}
+
+	struct sbcopy *c = &g_copies[g_ncopies++];
+	uint16_t version = GET16P(&raw[0x64]);
+	c->off = off;
+	memcpy(&c->sb, raw, sizeof(xfs_sb_t));
+	/* as in sb_features() */
+	if((version & XFS_SB_VERSION_NUMBITS) == 5) {
+		c->ftype = GET32P(&raw[0xd8]) & 1;
+		c->crcok = sectsize <= len && xfs_cksum_ok(raw, sectsize, 0xe0);
+	} else {
+		c->ftype = (version & 0x8000) && (GET32P(&raw[0xc8]) & 0x200);
+		c->crcok = 1;
+	}
+	eprintf(INFO, "Superblock at 0x%llx (AG %llu)%s", off, off / agbytes, c->crcok ? "" : ", bad CRC");
+	return 1;
+}
+
+/* The backups of a filesystem with AGs of agbytes */
+static void try_ags(uint64_t agbytes, uint64_t nags)
+{
+	static uint64_t tried[64];
+	static unsigned ntried;
+	uint64_t ag;
+	unsigned i;
+
+	for(i=0; i<ntried; i++)
+		if(tried[i] == agbytes) return;
+	if(ntried < 64) tried[ntried++] = agbytes;
+	for(ag=0; ag<nags && ag*agbytes < g_devsize && g_reads < g_maxreads; ag++)
+		try_sb(ag*agbytes);
+}
+
+/* Without any copy: mkfs makes AGs of ceil(dblocks/agcount) blocks, and the
+   filesystem usually fills the device. AG 1 holds the first backup. AG
+   sizes that are powers of two are tried too, as they hide from the inode
+   numbers (see inode_guess()). */
+static void try_mkfs_layouts(void)
+{
+	static const unsigned blocksizes[] = { 4096, 512, 1024, 2048, 8192, 16384, 32768, 65536 };
+	unsigned i, agcount;
+	for(i=0; i<sizeof(blocksizes)/sizeof(blocksizes[0]) && !g_ncopies; i++) {
+		uint64_t dblocks = g_devsize / blocksizes[i];
+		for(agcount=2; agcount<=64 && !g_ncopies && g_reads < g_maxreads; agcount++)
+			try_sb((dblocks + agcount-1) / agcount * blocksizes[i]);
+	}
+	for(i=12; i<64 && (1ULL << i) < g_devsize && !g_ncopies; i++)
+		try_sb(1ULL << i);
+}
+
+static int inode_ok(const unsigned char *p)
+{
+	uint16_t mode = GET16P(&p[2]);
+	unsigned fmt = p[5];
+	if(GET16P(p) != XFS_DINODE_MAGIC || (p[4] != 2 && p[4] != 3) || fmt > XFS_DINODE_FMT_UUID) return 0;
+	switch(mode & S_IFMT) {
+	case S_IFREG: case S_IFDIR: case S_IFLNK: case S_IFCHR: case S_IFBLK: case S_IFIFO: case S_IFSOCK:
+		return 1;
+	case 0: /* free, still initialized */
+		return !mode;
+	}
+	return 0;
+}
+
+/* Scans the chunk at off for inodes; returns the smallest distance between
+   two of them, 0 for fewer than two. */
+static unsigned scan_chunk(uint64_t off, unsigned char *buf)
+{
+	size_t len = g_devsize - off < PROBE_CHUNK ? g_devsize - off : PROBE_CHUNK, i;
+	unsigned stride = 0;
+	uint64_t last = UINT64_MAX;
+
+	if(dev_read(g_fp, buf, len, off) < 0) return 0;
+	for(i=0; i+256 <= len; i+=256) {
+		if(!inode_ok(&buf[i])) continue;
+		if(last != UINT64_MAX && (!stride || i - last < stride)) stride = i - last;
+		last = i;
+		if(g_ninodes < PROBE_MAXINODES) {
+			struct inohit *h = &g_inodes[g_ninodes++];
+			h->off = off + i;
+			h->version = buf[i+4];
+			h->ino = h->version == 3 && i + 0xa0 <= len ? GET64P(&buf[i+0x98]) : 0;
+		}
+	}
+	return stride;
+}
+
+/* Most frequent value among n, and its count; ties go to the larger */
+static uint64_t vote(const uint64_t *v, unsigned n, unsigned *count)
+{
+	unsigned i, j, best = 0;
+	uint64_t winner = 0;
+	for(i=0; i<n; i++) {
+		unsigned c = 0;
+		for(j=0; j<n; j++) c += v[j] == v[i];
+		if(c > best || (c == best && v[i] > winner)) best = c, winner = v[i];
+	}
+	*count = best;
+	return winner;
+}
+
+struct inoguess {
+	unsigned inodesize, version, nagbytes;
+	uint64_t agbytes[PROBE_AGSIZES]; /* candidates, likeliest first */
+};
+
+/* What the sampled inodes say */
+static void inode_guess(struct inoguess *g, const uint64_t *strides, unsigned nstrides)
+{
+	static uint64_t v[PROBE_MAXINODES];
+	unsigned i, n = 0, count;
+	uint64_t b;
+
+	memset(g, 0, sizeof(*g));
+	for(i=0; i<nstrides; i++)
+		if(is_pow2(strides[i], 256, 2048)) v[n++] = strides[i];
+	g->inodesize = vote(v, n, &count);
+	for(i=0; i<g_ninodes; i++) v[i] = g_inodes[i].version;
+	g->version = vote(v, g_ninodes, &count);
+	if(!g->inodesize) return;
+
+	/* A v3 inode at off in AG agno, numbered ino with inobits bits of
+	   AG-relative number: off = agno*agbytes + (ino & mask)*inodesize. Only
+	   the right inobits gives back an AG size that needs that many bits, but
+	   a smaller AG size with a larger agno can fit as well; the candidates
+	   are checked by looking for their backups. With AGs of a power of two
+	   blocks, off = ino*inodesize everywhere, as in AG 0, and nothing is
+	   learned. */
+	for(i=n=0; i<g_ninodes; i++) {
+		const struct inohit *h = &g_inodes[i];
+		if(h->version != 3 || !h->ino || h->ino * g->inodesize == h->off) continue;
+		for(b=1; b<64 && (h->ino >> b); b++) {
+			uint64_t agno = h->ino >> b, rel = (h->ino & XFS_MASK64LO(b)) * g->inodesize;
+			if(rel > h->off || (h->off - rel) % agno) continue;
+			uint64_t agbytes = (h->off - rel) / agno;
+			if(agbytes && agbytes % 512 == 0 && ceil_log2(agbytes / g->inodesize) == b && n < PROBE_MAXINODES)
+				v[n++] = agbytes;
+		}
+	}
+	while(n && g->nagbytes < PROBE_AGSIZES) {
+		uint64_t best = vote(v, n, &count);
+		unsigned k;
+		g->agbytes[g->nagbytes++] = best;
+		for(i=k=0; i<n; i++)
+			if(v[i] != best) v[k++] = v[i];
+		n = k;
+	}
+}
+
+/* The root directory is the lowest inode that is its own parent. Its
+   number is known from di_ino, or on v4 from being in AG 0. */
+static uint64_t find_root(unsigned inodesize)
+{
+	unsigned i;
+	uint64_t root = 0;
+	unsigned char buf[2048];
+	for(i=0; i<g_ninodes; i++) {
+		const struct inohit *h = &g_inodes[i];
+		unsigned fork = h->version == 3 ? INO_V3_FORK_OFFSET : INO_V2_FORK_OFFSET;
+		if(dev_read(g_fp, buf, inodesize, h->off) < 0) continue;
+		if(!S_ISDIR(GET16P(&buf[2])) || buf[5] != XFS_DINODE_FMT_LOCAL) continue;
+		uint64_t ino = h->version == 3 ? h->ino : h->off / inodesize;
+		uint64_t parent = buf[fork+1] ? GET64P(&buf[fork+2]) : GET32P(&buf[fork+2]);
+		if(parent == ino && (!root || ino < root)) root = ino;
+	}
+	return root;
+}
+
+void usage()
+{
+	printf("Find the filesystem geometry from superblock copies and inodes\n");
+	printf("usage: %s [-v -M -L logfile -n maxreads -s chunks -o geomfile] devfile\n", g_progname);
+	printf("-n bounds the superblock reads (default 4096), -s the %dKB chunks scanned for\n", PROBE_CHUNK>>10);
+	printf("inodes (default 64). Prints \"field<TAB>value<TAB>source\"; -o writes the geometry\n");
+	printf("to a file the other tools take as \"devfile,geom=geomfile\".\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *devfile = NULL, *outfile = NULL;
+	unsigned nchunks = 64, i, k;
+
+	while( (c=getopt(argc,argv,"vML:n:s:o:")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 'n':
+			g_maxreads = strtoull(optarg,0,0);
+			break;
+		case 's':
+			nchunks = atoi(optarg);
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind>=argc) {
+		usage();
+		exit(0);
+	}
+
+	devfile = argv[optind];
+
+	FILE *fp = dev_open(devfile);
+	if(!fp) { perror(strerror(errno)); exit(errno); }
+	fseeko(fp, 0, SEEK_END);
+	g_devsize = ftello(fp);
+	fseeko(fp, 0, SEEK_SET);
+	if(!g_devsize) { eprintf(ERR, "%s is empty", devfile); exit(1); }
+	g_fp = fp;
+
+	try_sb(0);
+	if(!g_ncopies) try_mkfs_layouts();
+	for(i=0; i<g_ncopies; i++)
+		try_ags(agbytes_of(&g_copies[i].sb), GET32(g_copies[i].sb.sb_agcount));
+
+	/* The start of AG 0, where the root is, then chunks spread over the device */
+	unsigned char *buf = malloc(PROBE_CHUNK);
+	uint64_t *strides = calloc(16 + nchunks, sizeof(uint64_t));
+	unsigned nstrides = 0;
+	if(!buf || !strides) { eprintf(ERR, "malloc() failed:"); exit(1); }
+	for(i=0; i<16+nchunks; i++) {
+		uint64_t off = i < 16 ? (uint64_t)i*PROBE_CHUNK : g_devsize / nchunks * (i-16) / PROBE_CHUNK * PROBE_CHUNK;
+		if(off >= g_devsize || (i >= 16 && off < 16*PROBE_CHUNK)) continue;
+		unsigned stride = scan_chunk(off, buf);
+		if(stride) strides[nstrides++] = stride;
+	}
+	struct inoguess g;
+	inode_guess(&g, strides, nstrides);
+	free(strides);
+	free(buf);
+	uint64_t root = find_root(g.inodesize ? g.inodesize : 256);
+	eprintf(INFO, "%u inodes sampled: inode size %u, v%u, %u AG sizes, root 0x%llx",
+		g_ninodes, g.inodesize, g.version, g.nagbytes, root);
+	for(k=0; k<g.nagbytes && !g_ncopies; k++) {
+		eprintf(INFO, "Trying AGs of 0x%llx bytes", g.agbytes[k]);
+		try_ags(g.agbytes[k], g_devsize / g.agbytes[k] + 1);
+		for(i=0; i<g_ncopies; i++)
+			try_ags(agbytes_of(&g_copies[i].sb), GET32(g_copies[i].sb.sb_agcount));
+	}
+	eprintf(INFO, "%u superblock copies in %llu reads", g_ncopies, g_reads);
+
+	/* Copies failing their CRC only count when no copy passes */
+	unsigned voters[PROBE_MAXCOPIES], nvoters = 0, count;
+	static uint64_t v[PROBE_MAXCOPIES];
+	int anycrc = 0;
+	for(i=0; i<g_ncopies; i++) anycrc |= g_copies[i].crcok;
+	for(i=0; i<g_ncopies; i++)
+		if(g_copies[i].crcok || !anycrc) voters[nvoters++] = i;
+
+	memset(&g_sb, 0, sizeof(g_sb));
+	if(nvoters) {
+		for(k=0; k<SB_NFIELDS; k++) {
+			for(i=0; i<nvoters; i++) v[i] = sb_get(&g_copies[voters[i]].sb, &g_sbfields[k]);
+			uint64_t val = vote(v, nvoters, &count);
+			sb_set(&g_sb, &g_sbfields[k], val);
+			printf("%s\t%llu\t%u/%u copies\n", g_sbfields[k].name, (unsigned long long)val, count, nvoters);
+		}
+		for(i=0; i<nvoters; i++) v[i] = g_copies[voters[i]].ftype;
+		g_ftype = vote(v, nvoters, &count);
+		printf("ftype\t%d\t%u/%u copies\n", g_ftype, count, nvoters);
+
+		if(g.inodesize && g.inodesize != GET16(g_sb.sb_inodesize))
+			eprintf(WARN, "The inodes look %u bytes apart, not %u", g.inodesize, GET16(g_sb.sb_inodesize));
+		if(root && root != GET64(g_sb.sb_rootino))
+			eprintf(WARN, "Inode 0x%llx looks like the root, not 0x%llx", root, GET64(g_sb.sb_rootino));
+	} else {
+		if(!g_ninodes) {
+			eprintf(ERR, "No superblock and no inodes found, is this XFS?");
+			exit(2);
+		}
+		eprintf(WARN, "No superblock copy found, guessing from the inodes and mkfs defaults");
+		/* mkfs: 4KB blocks, 512 byte sectors, 512 byte v3 or 256 byte v2 inodes */
+		int v5 = g.version != 2;
+		uint64_t blocksize = 4096, dblocks = g_devsize / blocksize;
+		uint64_t agblocks = g.nagbytes ? g.agbytes[0] / blocksize : dblocks;
+		uint64_t val[SB_NFIELDS] = { blocksize, dblocks, agblocks, (dblocks + agblocks-1) / agblocks, 512,
+			g.inodesize ? g.inodesize : v5 ? 512 : 256, 0, 0, root, v5 ? 5 : 4 };
+		const char *how[SB_NFIELDS] = { "default", "device size", g.nagbytes ? "inodes" : "one AG",
+			g.nagbytes ? "inodes" : "one AG", "default", g.inodesize ? "inodes" : "default",
+			"unknown", "unknown", root ? "inodes" : "unknown", g.version ? "inodes" : "default" };
+		for(k=0; k<SB_NFIELDS; k++) {
+			sb_set(&g_sb, &g_sbfields[k], val[k]);
+			printf("%s\t%llu\t%s\n", g_sbfields[k].name, (unsigned long long)val[k], how[k]);
+		}
+		g_ftype = v5;
+		printf("ftype\t%d\t%s\n", g_ftype, v5 ? "v5" : "default");
+	}
+
+	if(outfile && (sb_save(outfile) < 0 || sb_load(outfile) < 0)) exit(1);
+	return 0;
+}
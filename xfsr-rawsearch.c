@@ -2,15 +2,31 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <getopt.h>
 
 #define BLOCK_SIZE 4096 /* FIXME: Get the blocksize from the damn FS!  */
 
 char *progname;
+unsigned blocksize = BLOCK_SIZE;
+bitmap_t include, exclude; /* block masks from xfsr-owners */
 
 void usage()
 {
-	printf("usage: %s file seekstr [skipbytes]\n", progname);
+	printf("usage: %s [-k includemap -X excludemap] file seekstr [skipbytes]\n", progname);
 	printf("seekstr may be a hexadecimal byte array like 7a4453, if it's a string, prepend an 's' character to the string.\n");
+	printf("-k searches only the blocks in an xfsr-owners map, -X skips them. The block size then comes from the map.\n");
+}
+
+/* First block at or after b that the masks let through */
+uint64_t unmasked(uint64_t b)
+{
+	uint64_t prev;
+	do {
+		prev = b;
+		if(include.chunks) b = bitmap_next(&include, b, 1);
+		if(exclude.chunks) b = bitmap_next(&exclude, b, 0);
+	} while(b != prev);
+	return b;
 }
 
 int hex2n(char c)
@@ -34,6 +50,14 @@ int main(int argc, char *argv[])
 	int nread=0;
 
 	progname = (argv[0]);
+	while( (c=getopt(argc,argv,"k:X:")) != EOF ) {
+		bitmap_t *bm = c == 'k' ? &include : &exclude;
+		if(c != 'k' && c != 'X') { usage(); exit(0); }
+		if(bitmap_load(bm, optarg) < 0) exit(1);
+		blocksize = bm->blocksize;
+	}
+	argc -= optind-1;
+	argv += optind-1;
 	fname = argv[1];
 	sarg = argv[2];
 
@@ -53,17 +77,29 @@ int main(int argc, char *argv[])
 	fp = fopen(fname, "r");
 	if(!fp) { perror(strerror(errno)); exit(errno); }
 
+	uint64_t skip = 0, limit = include.chunks ? include.nblocks : exclude.nblocks;
 	if(argc==4) {
 		int i;
 		for(i=0; i<strtoull(argv[3],0,16); i++)
-			fseeko(fp, BLOCK_SIZE*1024, SEEK_CUR);
+			fseeko(fp, blocksize*1024, SEEK_CUR);
+		skip = strtoull(argv[3],0,16)*1024;
 	}
 	dprintf(INFO, "Seeking for \"%s\" in file \"%s\"\n", sarg, fname);
-	dprintf(INFO, "Block size = %d\n", BLOCK_SIZE);
+	dprintf(INFO, "Block size = %d\n", blocksize);
 	fflush(stdout);
-	while((c=fgetc(fp)) != EOF) {
+	for(;;) {
+		if(nread == 0 && (include.chunks || exclude.chunks)) {
+			uint64_t b = skip + nblocks, next = unmasked(b);
+			if(next >= limit) break;
+			if(next != b) {
+				fseeko(fp, next*blocksize, SEEK_SET);
+				nblocks = next - skip;
+				p = s; /* no matches across skipped blocks */
+			}
+		}
+		if((c=fgetc(fp)) == EOF) break;
 		nread++;
-		if(nread == BLOCK_SIZE) {
+		if(nread == blocksize) {
 			nread=0;
 			nblocks++;
 			if(nblocks % (1024*1024) == 0) dprintf(INFO, "Current block = %llu\n", nblocks);
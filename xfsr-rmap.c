@@ -0,0 +1,378 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Reverse map: disk block -> inode and file offset. The extents and bmbt
+   blocks of every inode (from the inode btrees, or a census map) go into an
+   array sorted by disk block, which can be saved and loaded again. Queries
+   are disk offsets, or block:offset pairs as printed by xfsr-rawsearch;
+   each is found by binary search. Cross-linked extents overlap, so the
+   records are dealt into layers, each sorted and free of overlaps, and a
+   query searches every layer. There are only as many layers as extents
+   pile up on one block, however long a bogus extent is. */
+
+#include "xfsr.h"
+#include <string.h>
+#include <getopt.h>
+
+#define RMAP_MAGIC "XFSRRMP1"
+#define RMAP_BMBT UINT64_MAX /* fileoff of a bmbt block */
+
+struct rmap_rec {
+	uint64_t start, ino, fileoff; /* blkadr, and logical block or RMAP_BMBT */
+	uint32_t len, layer;
+};
+
+static const char *g_progname = "xfsr-rmap";
+static struct rmap_rec *g_recs;
+static size_t g_nrecs, g_caprecs;
+static size_t *g_layers; /* first record of each layer, and g_nrecs */
+static unsigned g_nlayers;
+static uint64_t *g_iadrs;
+static size_t g_niadrs, g_capiadrs;
+static inotab_t g_paths; /* ino -> offset in g_pathbuf */
+static char *g_pathbuf;
+static size_t g_pathsize, g_pathcap;
+
+static void add_rec(uint64_t start, uint64_t len, uint64_t ino, uint64_t fileoff)
+{
+	if(g_nrecs == g_caprecs) {
+		size_t cap = g_caprecs ? 2*g_caprecs : 4096;
+		struct rmap_rec *p = realloc(g_recs, cap*sizeof(*p));
+		if(!p) { eprintf(ERR, "realloc() failed:"); exit(1); }
+		g_recs = p;
+		g_caprecs = cap;
+	}
+	struct rmap_rec *r = &g_recs[g_nrecs++];
+	memset(r, 0, sizeof(*r));
+	r->start = start, r->len = len, r->ino = ino, r->fileoff = fileoff;
+}
+
+static void add_iadr(uint64_t iadr)
+{
+	if(g_niadrs == g_capiadrs) {
+		size_t cap = g_capiadrs ? 2*g_capiadrs : 4096;
+		uint64_t *p = realloc(g_iadrs, cap*sizeof(uint64_t));
+		if(!p) { eprintf(ERR, "realloc() failed:"); exit(1); }
+		g_iadrs = p;
+		g_capiadrs = cap;
+	}
+	g_iadrs[g_niadrs++] = iadr;
+}
+
+static void census_inodes(const uint8_t *census, uint64_t nblocks)
+{
+	uint64_t b;
+	unsigned i, n = GET16(g_sb.sb_inopblock);
+	for(b=0; b<nblocks; b++)
+		if((census[b] & ~BT_BAD) == BT_INODES)
+			for(i=0; i<n; i++) add_iadr((b << g_sb.sb_inopblog) + i);
+}
+
+static void map_inodes(FILE *fp)
+{
+	size_t batch = INODE_BATCH_MAX, i, k, j;
+	xfs_dinode_t *dinodes = malloc(batch*sizeof(xfs_dinode_t));
+	char *ok = malloc(batch);
+	extmap_t map;
+	if(!dinodes || !ok) { eprintf(ERR, "malloc() failed:"); exit(1); }
+	extmap_init(&map);
+
+	for(i=0; i<g_niadrs; i+=batch) {
+		size_t n = g_niadrs - i < batch ? g_niadrs - i : batch;
+		if(read_inodes(fp, &g_iadrs[i], n, dinodes, ok) < 0) exit(1);
+		for(k=0; k<n; k++) {
+			xfs_dinode_t *d = &dinodes[k];
+			int fmt = d->di_core.di_format;
+			if(!ok[k] || !GET16(d->di_core.di_mode)) continue;
+			if(fmt != XFS_DINODE_FMT_EXTENTS && fmt != XFS_DINODE_FMT_BTREE) continue;
+			if(extmap_load(fp, g_iadrs[i+k], d, &map) < 0) continue;
+
+			uint64_t ino = iadr_to_ino(g_iadrs[i+k]);
+			for(j=0; j<map.n; j++)
+				add_rec(blkno_to_blkadr(map.startblock[j]), map.count[j], ino, map.startoff[j]);
+			for(j=0; j<map.nbmblk; j++)
+				add_rec(blkno_to_blkadr(map.bmblk[j]), 1, ino, RMAP_BMBT);
+		}
+	}
+
+	extmap_free(&map);
+	free(dinodes);
+	free(ok);
+}
+
+static int rec_cmp(const void *a, const void *b)
+{
+	const struct rmap_rec *x = a, *y = b;
+	if(x->layer != y->layer) return x->layer < y->layer ? -1 : 1;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* In start order, each record goes to the first layer it doesn't overlap. */
+static void build_index(void)
+{
+	uint64_t *ends = NULL;
+	size_t i;
+	unsigned l;
+
+	g_nlayers = 0;
+	for(i=0; i<g_nrecs; i++) g_recs[i].layer = 0;
+	qsort(g_recs, g_nrecs, sizeof(*g_recs), rec_cmp);
+	for(i=0; i<g_nrecs; i++) {
+		struct rmap_rec *r = &g_recs[i];
+		for(l=0; l<g_nlayers && ends[l] > r->start; l++);
+		if(l == g_nlayers) {
+			uint64_t *p = realloc(ends, (g_nlayers+1)*sizeof(uint64_t));
+			if(!p) { eprintf(ERR, "realloc() failed:"); exit(1); }
+			ends = p;
+			g_nlayers++;
+		}
+		ends[l] = r->start + r->len;
+		r->layer = l;
+	}
+	free(ends);
+	qsort(g_recs, g_nrecs, sizeof(*g_recs), rec_cmp);
+
+	if(!(g_layers = malloc((g_nlayers+1)*sizeof(size_t)))) { eprintf(ERR, "malloc() failed:"); exit(1); }
+	for(i=0, l=0; l<=g_nlayers; l++) {
+		while(i < g_nrecs && g_recs[i].layer < l) i++;
+		g_layers[l] = i;
+	}
+	if(g_nlayers > 1) eprintf(INFO, "%u layers of overlapping extents", g_nlayers);
+}
+
+static int rmap_save(const char *path)
+{
+	FILE *fp = fopen(path, "w");
+	if(!fp) { eprintf(ERR, "Failed to create %s:", path); return -1; }
+	uint64_t n = g_nrecs;
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	if(fwrite(RMAP_MAGIC, 8, 1, fp) != 1 || fwrite(&blocksize, 4, 1, fp) != 1 || fwrite(&n, 8, 1, fp) != 1 ||
+			fwrite(g_recs, sizeof(*g_recs), g_nrecs, fp) != g_nrecs || fclose(fp) != 0) {
+		eprintf(ERR, "Failed to write %s:", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int rmap_load(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if(!fp) { eprintf(ERR, "Failed to open %s:", path); return -1; }
+	char magic[8];
+	uint32_t blocksize;
+	uint64_t n;
+	if(fread(magic, 8, 1, fp) != 1 || memcmp(magic, RMAP_MAGIC, 8) || fread(&blocksize, 4, 1, fp) != 1 ||
+			fread(&n, 8, 1, fp) != 1 || blocksize != GET32(g_sb.sb_blocksize)) {
+		eprintf(ERR, "%s is not a reverse map of this filesystem", path);
+		fclose(fp);
+		return -1;
+	}
+	if(!(g_recs = malloc(n*sizeof(*g_recs))) || fread(g_recs, sizeof(*g_recs), n, fp) != n) {
+		eprintf(ERR, "Failed to read %s:", path);
+		fclose(fp);
+		return -1;
+	}
+	g_nrecs = g_caprecs = n;
+	fclose(fp);
+	return 0;
+}
+
+/* "ino<TAB>path" lines, as xfsr-sched takes them */
+static int load_paths(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if(!fp) { eprintf(ERR, "Failed to open %s:", path); return -1; }
+	inotab_init(&g_paths, sizeof(uint64_t));
+
+	char *line = NULL, *end;
+	size_t cap = 0;
+	ssize_t len;
+	while((len = getline(&line, &cap, fp)) > 0) {
+		if(line[len-1] == '\n') line[--len] = '\0';
+		uint64_t ino = strtoull(line, &end, 0);
+		if(end == line || *end != '\t' || !ino) continue;
+		size_t plen = strlen(end+1) + 1;
+		if(g_pathsize + plen > g_pathcap) {
+			size_t c = g_pathcap ? 2*g_pathcap : 1<<16;
+			while(c < g_pathsize + plen) c *= 2;
+			char *p = realloc(g_pathbuf, c);
+			if(!p) { eprintf(ERR, "realloc() failed:"); exit(1); }
+			g_pathbuf = p;
+			g_pathcap = c;
+		}
+		uint64_t *off = inotab_put(&g_paths, ino);
+		if(!off) exit(1);
+		*off = g_pathsize;
+		memcpy(&g_pathbuf[g_pathsize], end+1, plen);
+		g_pathsize += plen;
+	}
+	free(line);
+	fclose(fp);
+	return 0;
+}
+
+static const char *path_of(uint64_t ino)
+{
+	uint64_t *off = g_pathbuf ? inotab_get(&g_paths, ino) : NULL;
+	return off ? &g_pathbuf[*off] : "-";
+}
+
+/* Prints every owner of the byte at off; returns how many there are. */
+static unsigned resolve(const char *query, uint64_t off)
+{
+	uint64_t blkadr = off >> g_sb.sb_blocklog;
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	unsigned n = 0, l;
+
+	for(l=0; l<g_nlayers; l++) {
+		/* Last entry of the layer that starts at or before blkadr */
+		size_t lo = g_layers[l], hi = g_layers[l+1];
+		while(lo < hi) {
+			size_t mid = (lo+hi)/2;
+			if(g_recs[mid].start <= blkadr) lo = mid+1;
+			else hi = mid;
+		}
+		if(lo == g_layers[l]) continue;
+		const struct rmap_rec *r = &g_recs[lo-1];
+		if(blkadr >= r->start + r->len) continue;
+		if(r->fileoff == RMAP_BMBT)
+			printf("%s\t0x%llx\tbmbt\t%s\n", query, (unsigned long long)r->ino, path_of(r->ino));
+		else
+			printf("%s\t0x%llx\t%llu\t%s\n", query, (unsigned long long)r->ino,
+				(unsigned long long)((r->fileoff + blkadr - r->start) * blocksize + off % blocksize), path_of(r->ino));
+		n++;
+	}
+	if(!n) printf("%s\tunowned\n", query);
+	return n;
+}
+
+void usage()
+{
+	printf("Map disk offsets back to the inodes and file offsets they belong to\n");
+	printf("usage: %s [-v -M -L logfile -c censusmap -o rmapfile -p pathlist -b rawblocksize -q queryfile] devfile\n", g_progname);
+	printf("       %s -r rmapfile [-p pathlist -b rawblocksize -q queryfile] devfile\n", g_progname);
+	printf("Queries (from queryfile, or stdin) are byte offsets, or block:offset as printed by\n");
+	printf("xfsr-rawsearch, with blocks of rawblocksize bytes (default 4096). Each owner is printed\n");
+	printf("as \"query<TAB>ino<TAB>fileoffset<TAB>path\" (fileoffset is \"bmbt\" for bmap blocks),\n");
+	printf("or \"query<TAB>unowned\". pathlist has \"ino<TAB>path\" lines.\n");
+	printf("-o saves the map built from the device; -r loads one instead.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *devfile = NULL, *censusfile = NULL, *savefile = NULL, *loadfile = NULL, *pathfile = NULL, *queryfile = NULL;
+	uint64_t rawblocksize = 4096;
+
+	while( (c=getopt(argc,argv,"vML:c:o:r:p:b:q:")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 'c':
+			censusfile = optarg;
+			break;
+		case 'o':
+			savefile = optarg;
+			break;
+		case 'r':
+			loadfile = optarg;
+			break;
+		case 'p':
+			pathfile = optarg;
+			break;
+		case 'b':
+			rawblocksize = strtoull(optarg,0,0);
+			break;
+		case 'q':
+			queryfile = optarg;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind>=argc) {
+		usage();
+		exit(0);
+	}
+
+	devfile = argv[optind];
+
+	FILE *fp = dev_open(devfile);
+	if(!fp) { perror(strerror(errno)); exit(errno); }
+
+	if(read_sb(fp) <0) {
+		eprintf(ERR, "Not a valid superblock");
+		exit(2);
+	}
+	sb_print();
+
+	if(loadfile) {
+		if(rmap_load(loadfile) < 0) exit(1);
+	} else {
+		uint64_t ag;
+		if(censusfile) {
+			uint64_t censusblocks;
+			const uint8_t *census = census_load(censusfile, 0, &censusblocks);
+			if(!census) exit(1);
+			census_inodes(census, censusblocks);
+		}
+		agwalk_t w = { NULL, NULL, censusfile ? NULL : add_iadr, 0 };
+		for(ag=0; !censusfile && ag<GET32(g_sb.sb_agcount); ag++)
+			agwalk(fp, ag, &w);
+		eprintf(INFO, "%zu inodes to look at", g_niadrs);
+		map_inodes(fp);
+	}
+	build_index();
+	eprintf(INFO, "%zu extents in the map", g_nrecs);
+	if(savefile && rmap_save(savefile) < 0) exit(1);
+	if(pathfile && load_paths(pathfile) < 0) exit(1);
+	if(savefile && !queryfile) return 0;
+
+	FILE *qfp = queryfile ? fopen(queryfile, "r") : stdin;
+	if(!qfp) { eprintf(ERR, "Failed to open %s:", queryfile); exit(1); }
+
+	char *line = NULL, *end;
+	size_t cap = 0;
+	ssize_t len;
+	uint64_t nq = 0, nowned = 0;
+	while((len = getline(&line, &cap, qfp)) > 0) {
+		if(line[len-1] == '\n') line[--len] = '\0';
+		uint64_t off = strtoull(line, &end, 0);
+		if(end == line) continue;
+		if(*end == ':') /* rawsearch: the offset may be negative when a match started a block earlier */
+			off = off * rawblocksize + strtoll(end+1, NULL, 10);
+		nq++;
+		nowned += resolve(line, off) > 0;
+	}
+	free(line);
+	eprintf(INFO, "%llu queries, %llu owned", nq, nowned);
+	return 0;
+}
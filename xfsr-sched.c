@@ -0,0 +1,399 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Recovery scheduler. Takes a recovery set ("ino<TAB>path" lines, as printed
+   by xfsr-index and xfsr-ls -m, or [ENTRY] lines of xfsr-ls), reads all the
+   inodes first, then dumps the files in the order a policy asks for, until a
+   time or byte budget runs out. What was not recovered is written out in the
+   input format, so it can be fed back in later. */
+
+#include "xfsr.h"
+#include <string.h>
+#include <getopt.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <time.h>
+
+#define SCHED_MAXCLASSES 64
+#define SCHED_LINE 8192
+
+enum policy { POL_SMALLEST, POL_DENSITY, POL_EXTENTS, POL_ORDER };
+enum jstate { J_PENDING, J_DONE, J_FAILED, J_INVALID }; /* job_cmp() sorts by this order */
+
+void set_dump_opts(int preserve);
+void set_dump_jobs(int n);
+void set_dump_prefix(const char *prefix);
+int dump(FILE *devfp, const char *outfile, uint64_t iadr);
+
+struct job {
+	uint64_t ino, iadr, size;
+	uint32_t nextents;
+	uint16_t mode;
+	uint8_t format, cls, state;
+	size_t seq; /* position in the input */
+	char *path;
+};
+
+static const char *g_progname = "xfsr-sched";
+static enum policy g_policy = POL_SMALLEST;
+static const char *g_class[SCHED_MAXCLASSES];
+static unsigned g_nclass;
+static int g_dryrun;
+
+static struct job *g_jobs;
+static size_t g_njobs, g_capjobs;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Relative path under the dump dir: no leading '/', no empty or ".."
+   components. An unrooted index path "<0x83>/b" becomes "0x83/b". */
+static char *clean_path(const char *in)
+{
+	char *out = malloc(strlen(in) + 1), *o = out;
+	if(!out) return NULL;
+
+	while(*in) {
+		while(*in == '/') in++;
+		size_t len = strcspn(in, "/");
+		if(len == 0) break;
+		if((len == 1 && in[0] == '.') || (len == 2 && in[0] == '.' && in[1] == '.')) {
+			in += len;
+			continue;
+		}
+		if(o != out) *o++ = '/';
+		if(in[0] == '<' && in[len-1] == '>' && len > 2) {
+			memcpy(o, in+1, len-2);
+			o += len-2;
+		} else {
+			memcpy(o, in, len);
+			o += len;
+		}
+		in += len;
+	}
+	*o = '\0';
+	if(o == out) { free(out); return NULL; }
+	return out;
+}
+
+static int add_job(uint64_t ino, const char *path)
+{
+	if(g_njobs == g_capjobs) {
+		size_t cap = g_capjobs ? 2*g_capjobs : 1024;
+		struct job *p = realloc(g_jobs, cap*sizeof(*p));
+		if(!p) { eprintf(ERR, "realloc() failed:"); return -1; }
+		g_jobs = p;
+		g_capjobs = cap;
+	}
+	char *cp = clean_path(path);
+	if(!cp) { eprintf(WARN, "Skipping 0x%llx: no usable path in \"%s\"", ino, path); return 0; }
+
+	struct job *j = &g_jobs[g_njobs];
+	memset(j, 0, sizeof(*j));
+	j->ino = ino;
+	j->iadr = ino_to_iadr(ino);
+	j->path = cp;
+	j->seq = g_njobs++;
+	return 0;
+}
+
+/* Accepts "ino<TAB>path" and "[ENTRY]<TAB>iadr<TAB>ino<TAB>size<TAB>mode<TAB>uid<TAB>gid<TAB>name" */
+static int read_set(FILE *fp)
+{
+	char line[SCHED_LINE];
+	while(fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		char *f[8] = { 0 }, *end;
+		unsigned n = 0;
+		f[n++] = strtok(line, "\t");
+		for(; f[n-1] && n < 8; n++) f[n] = strtok(NULL, n == 7 ? "" : "\t");
+
+		char *ino_s = f[0], *path = f[1];
+		if(f[0] && !strcmp(f[0], "[ENTRY]")) {
+			if(n < 8 || !f[7]) continue;
+			ino_s = f[2], path = f[7];
+			if(!strcmp(path, ".") || !strcmp(path, "..")) continue;
+		}
+		if(!ino_s) continue;
+
+		uint64_t ino = strtoull(ino_s, &end, 0);
+		if(end == ino_s || *end || ino == 0 || !path) {
+			eprintf(WARN, "Can't parse line with \"%s\"", ino_s);
+			continue;
+		}
+		if(add_job(ino, path) < 0) return -1;
+	}
+	return 0;
+}
+
+/* The metadata pass: every inode of the set, in batches, in disk order. */
+static int load_inodes(FILE *devfp)
+{
+	size_t batch = INODE_BATCH_MAX, i, k;
+	uint64_t *iadrs = malloc(batch*sizeof(uint64_t));
+	xfs_dinode_t *dinodes = malloc(batch*sizeof(xfs_dinode_t));
+	char *ok = malloc(batch);
+	if(!iadrs || !dinodes || !ok) {
+		eprintf(ERR, "malloc() failed:");
+		free(iadrs); free(dinodes); free(ok);
+		return -1;
+	}
+
+	for(i=0; i<g_njobs; i+=batch) {
+		size_t n = g_njobs - i < batch ? g_njobs - i : batch;
+		for(k=0; k<n; k++) iadrs[k] = g_jobs[i+k].iadr;
+		if(read_inodes(devfp, iadrs, n, dinodes, ok) < 0) {
+			free(iadrs); free(dinodes); free(ok);
+			return -1;
+		}
+		for(k=0; k<n; k++) {
+			struct job *j = &g_jobs[i+k];
+			const xfs_dinode_t *d = &dinodes[k];
+			if(!ok[k]) {
+				/* Still wanted: it goes to the remain list as failed */
+				eprintf(WARN, "Can't read the inode of %s (ino=0x%llx)", j->path, j->ino);
+				j->state = J_FAILED;
+				continue;
+			}
+			j->mode = GET16(d->di_core.di_mode);
+			if(!S_ISREG(j->mode) && !S_ISLNK(j->mode)) {
+				if(!S_ISDIR(j->mode)) eprintf(WARN, "Skipping %s (ino=0x%llx): not a file", j->path, j->ino);
+				j->state = J_INVALID;
+				continue;
+			}
+			j->size = GET64(d->di_core.di_size);
+			j->format = d->di_core.di_format;
+			j->nextents = GET32(d->di_core.di_nextents);
+		}
+	}
+
+	free(iadrs);
+	free(dinodes);
+	free(ok);
+	return 0;
+}
+
+static unsigned job_class(const struct job *j)
+{
+	unsigned i;
+	for(i=0; i<g_nclass; i++)
+		if(!fnmatch(g_class[i], j->path, 0)) return i;
+	return g_nclass;
+}
+
+/* Files held in the inode and symlinks cost no data seeks; they go first. */
+static int job_ismeta(const struct job *j)
+{
+	return S_ISLNK(j->mode) || j->format == XFS_DINODE_FMT_LOCAL || j->size == 0;
+}
+
+static int cmp_u64(uint64_t a, uint64_t b)
+{
+	return a < b ? -1 : a > b;
+}
+
+static int job_cmp(const void *pa, const void *pb)
+{
+	const struct job *a = pa, *b = pb;
+	int r;
+
+	if(a->state != b->state) return a->state < b->state ? -1 : 1;
+	if(job_ismeta(a) != job_ismeta(b)) return job_ismeta(a) ? -1 : 1;
+	if(a->cls != b->cls) return a->cls < b->cls ? -1 : 1;
+
+	switch(g_policy) {
+	case POL_SMALLEST:
+		if((r = cmp_u64(a->size, b->size))) return r;
+		break;
+	case POL_DENSITY: /* bytes per extent, largest first */
+		{
+			double da = (double)a->size / (a->nextents ? a->nextents : 1);
+			double db = (double)b->size / (b->nextents ? b->nextents : 1);
+			if(da != db) return da > db ? -1 : 1;
+		}
+		break;
+	case POL_EXTENTS:
+		if((r = cmp_u64(a->nextents, b->nextents))) return r;
+		if((r = cmp_u64(a->size, b->size))) return r;
+		break;
+	case POL_ORDER:
+		return cmp_u64(a->seq, b->seq);
+	}
+	/* Ties in disk order of the inode; XFS keeps data near its inode */
+	if((r = cmp_u64(a->iadr, b->iadr))) return r;
+	return cmp_u64(a->seq, b->seq);
+}
+
+static void mkdir_parents(const char *path)
+{
+	char buf[strlen(path) + 1], *p;
+	strcpy(buf, path);
+	for(p=strchr(buf, '/'); p; p=strchr(p+1, '/')) {
+		*p = '\0';
+		if(mkdir(buf, 0755) < 0 && errno != EEXIST)
+			eprintf(WARN, "mkdir(%s) failed:", buf);
+		*p = '/';
+	}
+}
+
+static void usage()
+{
+	printf("Recover a set of files in priority order, within a time or byte budget\n");
+	printf("usage: %s [-v -n -p -M -L logfile -j jobs -P policy -c glob... -t seconds -b bytes -r remainfile -D dumpdir] setfile devfile\n", g_progname);
+	printf("setfile holds \"ino<TAB>path\" lines (xfsr-index, xfsr-ls -m) or xfsr-ls [ENTRY] lines; - is stdin.\n");
+	printf("Policies: smallest (default), density (bytes per extent), extents (fewest first), order (as given).\n");
+	printf("Each -c glob makes a priority class, the first one highest; unmatched paths come last.\n");
+	printf("Symlinks and files stored in the inode always go first. -n prints the plan only.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	double tbudget = 0;
+	uint64_t bbudget = 0;
+	const char *remainfile = NULL, *dumpdir = NULL;
+
+	while( (c=getopt(argc,argv,"vnpML:j:P:c:t:b:r:D:")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'n':
+			g_dryrun = 1;
+			break;
+		case 'p':
+			set_dump_opts(1);
+			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 'j':
+			set_dump_jobs(atoi(optarg));
+			break;
+		case 'P':
+			if(!strcmp(optarg, "smallest")) g_policy = POL_SMALLEST;
+			else if(!strcmp(optarg, "density")) g_policy = POL_DENSITY;
+			else if(!strcmp(optarg, "extents")) g_policy = POL_EXTENTS;
+			else if(!strcmp(optarg, "order")) g_policy = POL_ORDER;
+			else { usage(); exit(1); }
+			break;
+		case 'c':
+			if(g_nclass == SCHED_MAXCLASSES) { eprintf(ERR, "Too many classes"); exit(1); }
+			g_class[g_nclass++] = optarg;
+			break;
+		case 't':
+			tbudget = atof(optarg);
+			break;
+		case 'b':
+			bbudget = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			remainfile = optarg;
+			break;
+		case 'D':
+			dumpdir = optarg;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind+2 != argc || (!dumpdir && !g_dryrun)) {
+		usage();
+		exit(0);
+	}
+
+	double t0 = now();
+	FILE *devfp = dev_open(argv[optind+1]);
+	if(!devfp) { perror(strerror(errno)); exit(errno); }
+
+	if(read_sb(devfp) <0) {
+		eprintf(ERR, "Not a valid superblock");
+		exit(2);
+	}
+	sb_print();
+
+	FILE *setfp = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+	if(!setfp) { perror(strerror(errno)); exit(errno); }
+	if(read_set(setfp) < 0) exit(1);
+	if(setfp != stdin) fclose(setfp);
+
+	if(load_inodes(devfp) < 0) exit(1);
+	size_t i;
+	for(i=0; i<g_njobs; i++) g_jobs[i].cls = job_class(&g_jobs[i]);
+	qsort(g_jobs, g_njobs, sizeof(*g_jobs), job_cmp);
+
+	FILE *remfp = NULL;
+	if(remainfile && !(remfp = fopen(remainfile, "w"))) { perror(strerror(errno)); exit(errno); }
+	if(dumpdir && chdir(dumpdir)) { eprintf(ERR, "chdir() failed:"); exit(1); }
+	set_dump_prefix("");
+
+	/* Bulk pass. The byte budget skips what doesn't fit and tries the rest;
+	   the time budget also skips files that, at the rate seen so far,
+	   would not finish in time. */
+	uint64_t done = 0, donebytes = 0, failed = 0, left = 0, leftbytes = 0;
+	double tstart = now();
+	for(i=0; i<g_njobs; i++) {
+		struct job *j = &g_jobs[i];
+		if(j->state == J_INVALID || (g_dryrun && j->state == J_FAILED)) continue;
+
+		double elapsed = now() - t0, rate = donebytes / (now() - tstart + 1e-9);
+		int fits = (!bbudget || donebytes + j->size <= bbudget) &&
+			(!tbudget || (elapsed < tbudget && (donebytes < (1<<20) || elapsed + j->size / rate <= tbudget)));
+
+		if(g_dryrun) {
+			printf("%u\t%llu\t%u\t0x%llx\t%s\n", j->cls, (unsigned long long)j->size, j->nextents, (unsigned long long)j->ino, j->path);
+			continue;
+		}
+		if(j->state == J_FAILED) {
+			failed++;
+		} else if(fits) {
+			mkdir_parents(j->path);
+			if(dump(devfp, j->path, j->iadr) == 0) {
+				j->state = J_DONE;
+				done++;
+				donebytes += j->size;
+				TRACE("sched: done ino=0x%llx size=%llu", j->ino, j->size);
+				continue;
+			}
+			j->state = J_FAILED;
+			failed++;
+		}
+		left++;
+		leftbytes += j->size;
+		if(remfp) fprintf(remfp, "0x%llx\t/%s\n", (unsigned long long)j->ino, j->path);
+	}
+
+	if(remfp) fclose(remfp);
+	if(!g_dryrun)
+		printf("recovered %llu files, %llu bytes in %.1fs; %llu files, %llu bytes left (%llu failed)\n",
+			(unsigned long long)done, (unsigned long long)donebytes, now() - t0, (unsigned long long)left, (unsigned long long)leftbytes, (unsigned long long)failed);
+	return failed ? 3 : 0;
+}
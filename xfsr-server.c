@@ -0,0 +1,427 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Recovery server. The device, the superblock, inode cores and parsed
+   directories stay resident between commands. Requests are read one per
+   line from stdin or from clients of a Unix socket (served one at a time).
+   Requests may be pipelined, and the answers come back in order:
+
+	ok <n>		followed by n tab-separated lines
+	err <message>
+
+   Commands (inos may be decimal or 0x hex):
+	ls <ino>		ino mode size uid gid name, per entry
+	stat <ino>		ino iadr mode size uid gid nlink mtime format nextents
+	dump <ino> <outfile>	outfile
+	lookup <path>		ino path; path is /a/b, or <0xino>/a/b to start at a directory
+	find <regex>		ino path, from the index given with -x
+	quit			close this connection
+	shutdown		stop the server */
+
+#define _GNU_SOURCE
+#include "xfsr.h"
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVER_LINE 4096
+#define SERVER_MAXINODES (1<<20) /* cached inode cores before the cache is dropped */
+#define SERVER_MAXDIRENTS (1<<22) /* cached directory entries, likewise */
+
+enum { CMD_OK, CMD_QUIT, CMD_SHUTDOWN };
+
+void set_dump_opts(int preserve);
+int dump(FILE *devfp, const char *outfile, uint64_t iadr);
+
+static const char *g_progname = "xfsr-server";
+static inotab_t g_icache; /* ino -> xfs_dinode_t */
+static inotab_t g_dcache; /* ino -> dirlist_t */
+static size_t g_dcache_ents;
+static int g_index;
+static const char *g_err;
+
+static const xfs_dinode_t *get_inode(FILE *devfp, uint64_t ino)
+{
+	xfs_dinode_t *d = inotab_get(&g_icache, ino);
+	if(d) return d;
+
+	xfs_dinode_t dinode;
+	if(read_inode(devfp, &dinode, ino_to_iadr(ino)) < 0) {
+		g_err = "not a valid inode";
+		return NULL;
+	}
+	if(g_icache.n >= SERVER_MAXINODES) inotab_clear(&g_icache);
+	d = inotab_put(&g_icache, ino);
+	if(!d) { g_err = "out of memory"; return NULL; }
+	*d = dinode;
+	return d;
+}
+
+static void dcache_drop(void)
+{
+	size_t i;
+	for(i=0; i<g_dcache.cap; i++)
+		if(g_dcache.keys[i])
+			dirlist_free((dirlist_t*)&g_dcache.vals[i*g_dcache.valsize]);
+	inotab_clear(&g_dcache);
+	g_dcache_ents = 0;
+}
+
+/* Entries of directory ino; the children's inode cores are pulled into the
+   inode cache in one batched pass, as xfsr-ls does. */
+static const dirlist_t *get_dir(FILE *devfp, uint64_t ino)
+{
+	dirlist_t *dl = inotab_get(&g_dcache, ino);
+	if(dl) return dl;
+
+	const xfs_dinode_t *dinode = get_inode(devfp, ino);
+	if(!dinode) return NULL;
+	if(!dinode_isdir(dinode)) { g_err = "not a directory"; return NULL; }
+
+	dirlist_t tmp;
+	memset(&tmp, 0, sizeof(tmp));
+	xfs_dinode_t core = *dinode;
+	if(dir_collect(devfp, ino_to_iadr(ino), &core, &tmp) < 0) {
+		dirlist_free(&tmp);
+		g_err = "unreadable directory";
+		return NULL;
+	}
+
+	uint64_t *iadrs = malloc(tmp.n*sizeof(uint64_t));
+	xfs_dinode_t *dinodes = malloc(tmp.n*sizeof(xfs_dinode_t));
+	char *ok = malloc(tmp.n);
+	size_t i;
+	if(iadrs && dinodes && ok) {
+		for(i=0; i<tmp.n; i++)
+			iadrs[i] = ino_to_iadr(tmp.ino[i]);
+		read_inodes(devfp, iadrs, tmp.n, dinodes, ok);
+		if(g_icache.n + tmp.n >= SERVER_MAXINODES) inotab_clear(&g_icache);
+		for(i=0; i<tmp.n; i++) {
+			xfs_dinode_t *d;
+			if(ok[i] && (d = inotab_put(&g_icache, tmp.ino[i]))) *d = dinodes[i];
+		}
+	}
+	free(iadrs);
+	free(dinodes);
+	free(ok);
+
+	if(g_dcache_ents + tmp.n > SERVER_MAXDIRENTS) dcache_drop();
+	dl = inotab_put(&g_dcache, ino);
+	if(!dl) { dirlist_free(&tmp); g_err = "out of memory"; return NULL; }
+	*dl = tmp;
+	g_dcache_ents += tmp.n;
+	return dl;
+}
+
+/* Names may hold anything but '/' and NUL; keep the lines parseable. */
+static void put_name(FILE *m, const char *s)
+{
+	for(; *s; s++) {
+		if(*s == '\t') fputs("\\t", m);
+		else if(*s == '\n') fputs("\\n", m);
+		else if(*s == '\\') fputs("\\\\", m);
+		else fputc(*s, m);
+	}
+}
+
+static int parse_ino(const char *arg, uint64_t *ino)
+{
+	char *end;
+	*ino = strtoull(arg, &end, 0);
+	if(end == arg || *ino == 0) { g_err = "bad inode number"; return -1; }
+	return 0;
+}
+
+static int cmd_ls(FILE *devfp, char *arg, FILE *m)
+{
+	uint64_t ino;
+	if(parse_ino(arg, &ino) < 0) return -1;
+	const dirlist_t *dl = get_dir(devfp, ino);
+	if(!dl) return -1;
+
+	size_t i;
+	for(i=0; i<dl->n; i++) {
+		const xfs_dinode_t *d = get_inode(devfp, dl->ino[i]);
+		if(!d) continue;
+		fprintf(m, "0x%llx\t%o\t%llu\t%u\t%u\t", (unsigned long long)dl->ino[i], GET16(d->di_core.di_mode),
+			(unsigned long long)GET64(d->di_core.di_size), GET32(d->di_core.di_uid), GET32(d->di_core.di_gid));
+		put_name(m, &dl->names[dl->nameoff[i]]);
+		fputc('\n', m);
+	}
+	return 0;
+}
+
+static int cmd_stat(FILE *devfp, char *arg, FILE *m)
+{
+	uint64_t ino;
+	if(parse_ino(arg, &ino) < 0) return -1;
+	const xfs_dinode_t *d = get_inode(devfp, ino);
+	if(!d) return -1;
+
+	fprintf(m, "0x%llx\t0x%llx\t%o\t%llu\t%u\t%u\t%u\t%u\t%u\t%u\n", (unsigned long long)ino, (unsigned long long)ino_to_iadr(ino),
+		GET16(d->di_core.di_mode), (unsigned long long)GET64(d->di_core.di_size),
+		GET32(d->di_core.di_uid), GET32(d->di_core.di_gid), GET32(d->di_core.di_nlink),
+		GET32(d->di_core.di_mtime.t_sec), d->di_core.di_format, GET32(d->di_core.di_nextents));
+	return 0;
+}
+
+static int cmd_dump(FILE *devfp, char *arg, FILE *m)
+{
+	uint64_t ino;
+	char *out = strchr(arg, ' ');
+	if(!out) { g_err = "usage: dump <ino> <outfile>"; return -1; }
+	*out++ = '\0';
+	if(parse_ino(arg, &ino) < 0) return -1;
+
+	if(dump(devfp, out, ino_to_iadr(ino)) != 0) { g_err = "dump failed"; return -1; }
+	put_name(m, out);
+	fputc('\n', m);
+	return 0;
+}
+
+static int cmd_lookup(FILE *devfp, char *arg, FILE *m)
+{
+	uint64_t ino = GET64(g_sb.sb_rootino);
+	char *p = arg;
+
+	if(*p == '<') {
+		char *end;
+		ino = strtoull(p+1, &end, 0);
+		if(*end != '>') { g_err = "bad path"; return -1; }
+		p = end+1;
+	}
+	if(*p != '/' && *p) { g_err = "path must be absolute"; return -1; }
+
+	while(*p) {
+		while(*p == '/') p++;
+		if(!*p) break;
+		char *name = p;
+		p += strcspn(p, "/");
+		char c = *p;
+		*p = '\0';
+
+		const dirlist_t *dl = get_dir(devfp, ino);
+		if(!dl) return -1;
+		size_t i;
+		for(i=0; i<dl->n; i++)
+			if(!strcmp(&dl->names[dl->nameoff[i]], name)) break;
+		if(i == dl->n) { g_err = "no such entry"; return -1; }
+		ino = dl->ino[i];
+		*p = c;
+	}
+
+	fprintf(m, "0x%llx\t", (unsigned long long)ino);
+	put_name(m, arg);
+	fputc('\n', m);
+	return 0;
+}
+
+static int cmd_find(FILE *devfp, char *arg, FILE *m)
+{
+	if(!g_index) { g_err = "no index (start with -x)"; return -1; }
+	if(index_search(m, arg, 1, 0, put_name) < 0) { g_err = "bad regex"; return -1; }
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*fn)(FILE *devfp, char *arg, FILE *m);
+} g_cmds[] = {
+	{ "ls", cmd_ls },
+	{ "stat", cmd_stat },
+	{ "dump", cmd_dump },
+	{ "lookup", cmd_lookup },
+	{ "find", cmd_find },
+};
+
+/* Runs one request line, writing the whole answer to out. */
+static int command(FILE *devfp, char *line, FILE *out)
+{
+	char *arg = line + strcspn(line, " ");
+	if(*arg) *arg++ = '\0';
+
+	if(!strcmp(line, "quit")) return CMD_QUIT;
+	if(!strcmp(line, "shutdown")) return CMD_SHUTDOWN;
+	if(!*line) return CMD_OK;
+
+	unsigned i;
+	for(i=0; i<sizeof(g_cmds)/sizeof(g_cmds[0]); i++)
+		if(!strcmp(line, g_cmds[i].name)) break;
+	if(i == sizeof(g_cmds)/sizeof(g_cmds[0])) {
+		fprintf(out, "err unknown command\n");
+		return CMD_OK;
+	}
+
+	/* The answer is buffered so its line count can lead it. */
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *m = open_memstream(&buf, &len);
+	if(!m) { fprintf(out, "err out of memory\n"); return CMD_OK; }
+
+	g_err = "failed";
+	int err = g_cmds[i].fn(devfp, arg, m);
+	fclose(m);
+
+	if(err < 0) {
+		fprintf(out, "err %s\n", g_err);
+	} else {
+		size_t k, n = 0;
+		for(k=0; k<len; k++) n += buf[k] == '\n';
+		fprintf(out, "ok %zu\n", n);
+		fwrite(buf, 1, len, out);
+	}
+	free(buf);
+	return CMD_OK;
+}
+
+static int serve(FILE *devfp, FILE *in, FILE *out)
+{
+	char line[SERVER_LINE];
+	while(fgets(line, sizeof(line), in)) {
+		size_t len = strlen(line);
+		if(len == sizeof(line)-1 && line[len-1] != '\n') {
+			/* Too long: one answer for the whole line, the rest is dropped */
+			int c;
+			while((c = getc(in)) != EOF && c != '\n');
+			fprintf(out, "err line too long\n");
+			fflush(out);
+			continue;
+		}
+		line[strcspn(line, "\r\n")] = '\0';
+		int r = command(devfp, line, out);
+		fflush(out);
+		if(r != CMD_OK) return r;
+	}
+	return CMD_QUIT;
+}
+
+static int serve_socket(FILE *devfp, const char *path)
+{
+	struct sockaddr_un sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(sa.sun_path)) { eprintf(ERR, "Socket path too long"); return -1; }
+	strcpy(sa.sun_path, path);
+
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(s < 0) { eprintf(ERR, "socket() failed:"); return -1; }
+	unlink(path);
+	if(bind(s, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(s, 8) < 0) {
+		eprintf(ERR, "Can't listen on %s:", path);
+		close(s);
+		return -1;
+	}
+	eprintf(INFO, "Listening on %s", path);
+	/* A client that hangs up early must not take the server down */
+	signal(SIGPIPE, SIG_IGN);
+
+	int r = CMD_QUIT;
+	while(r != CMD_SHUTDOWN) {
+		int c = accept(s, NULL, NULL);
+		if(c < 0) {
+			if(errno == EINTR) continue;
+			eprintf(ERR, "accept() failed:");
+			break;
+		}
+		FILE *in = fdopen(c, "r"), *out = fdopen(dup(c), "w");
+		if(!in || !out) {
+			eprintf(ERR, "fdopen() failed:");
+			if(in) fclose(in); else close(c);
+			if(out) fclose(out);
+			continue;
+		}
+		r = serve(devfp, in, out);
+		fclose(in);
+		fclose(out);
+	}
+
+	close(s);
+	unlink(path);
+	return 0;
+}
+
+void usage()
+{
+	printf("Answer ls/stat/dump/lookup/find requests with the device kept open and caches warm\n");
+	printf("usage: %s [-v -p -M -L logfile -x indexfile -S socket] devfile\n", g_progname);
+	printf("Requests are read from stdin, or from clients of the Unix socket given with -S.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *devfile = NULL, *sockpath = NULL;
+	setlocale(LC_ALL, "");
+
+	while( (c=getopt(argc,argv,"vpML:x:S:")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'p':
+			set_dump_opts(1);
+			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 'x':
+			if(index_open(optarg) < 0) exit(1);
+			g_index = 1;
+			break;
+		case 'S':
+			sockpath = optarg;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind>=argc) {
+		usage();
+		exit(0);
+	}
+
+	devfile = argv[optind];
+
+	FILE *devfp = dev_open(devfile);
+	if(!devfp) { perror(strerror(errno)); exit(errno); }
+
+	if(read_sb(devfp) <0) {
+		eprintf(ERR, "Not a valid superblock");
+		exit(2);
+	}
+	sb_print();
+
+	inotab_init(&g_icache, sizeof(xfs_dinode_t));
+	inotab_init(&g_dcache, sizeof(dirlist_t));
+
+	if(sockpath) return -serve_socket(devfp, sockpath);
+	serve(devfp, stdin, stdout);
+	return 0;
+}
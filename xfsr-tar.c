@@ -0,0 +1,178 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* pax (POSIX.1-2001 tar) stream writer. Anything that doesn't fit a plain
+   ustar header (long names, big sizes or ids, sparse maps) goes into a pax
+   extended header in front of the entry. */
+
+#include "xfsr.h"
+#include <string.h>
+
+#define TAR_BLOCK 512
+
+/* Octal with a NUL, or GNU base-256 (high bit set, big-endian) when the
+   value needs all len digits */
+static void tar_octal(char *dst, unsigned len, uint64_t v)
+{
+	char tmp[32];
+	int n = snprintf(tmp, sizeof(tmp), "%0*llo", len-1, (unsigned long long)v);
+	if(n < (int)len) {
+		memcpy(dst, tmp, len);
+		return;
+	}
+	unsigned i;
+	for(i=len-1; i>0; i--, v >>= 8) dst[i] = v & 0xff;
+	dst[0] = (char)0x80;
+}
+
+/* Appends a "len key=value\n" record; len counts itself. */
+static void pax_add(char **buf, size_t *n, const char *key, const char *val)
+{
+	size_t body = strlen(key) + strlen(val) + 3, len = body + 1;
+	while(snprintf(NULL, 0, "%zu", len) + body > len) len++;
+
+	char *p = realloc(*buf, *n + len + 1);
+	if(!p) { eprintf(ERR, "realloc() failed:"); exit(1); }
+	sprintf(p + *n, "%zu %s=%s\n", len, key, val);
+	*buf = p;
+	*n += len;
+}
+
+static void tar_raw_header(FILE *fp, const char *name, unsigned mode, uint32_t uid, uint32_t gid,
+	uint64_t size, uint64_t mtime, char type, const char *linkname)
+{
+	unsigned char h[TAR_BLOCK];
+	memset(h, 0, sizeof(h));
+	strncpy((char*)&h[0], name, 100);
+	tar_octal((char*)&h[100], 8, mode & 07777);
+	tar_octal((char*)&h[108], 8, uid);
+	tar_octal((char*)&h[116], 8, gid);
+	tar_octal((char*)&h[124], 12, size);
+	tar_octal((char*)&h[136], 12, mtime);
+	h[156] = type;
+	if(linkname) strncpy((char*)&h[157], linkname, 100);
+	memcpy(&h[257], "ustar", 6);
+	memcpy(&h[263], "00", 2);
+
+	unsigned sum = 0, i;
+	memset(&h[148], ' ', 8);
+	for(i=0; i<TAR_BLOCK; i++) sum += h[i];
+	snprintf((char*)&h[148], 8, "%06o", sum);
+	h[155] = ' ';
+
+	if(fwrite(h, TAR_BLOCK, 1, fp) != 1) eprintf(ERR, "Write to tar stream failed:");
+}
+
+void tar_pad(FILE *fp, uint64_t size)
+{
+	static const char zeros[TAR_BLOCK];
+	unsigned r = size % TAR_BLOCK;
+	if(r && fwrite(zeros, TAR_BLOCK - r, 1, fp) != 1)
+		eprintf(ERR, "Write to tar stream failed:");
+}
+
+/* Writes the header(s) for one entry; size bytes of data must follow,
+   then tar_pad(). type is '0' (file), '2' (symlink), '5' (dir) or '1'
+   (hard link to linkname). pax holds extra records for the extended
+   header, already encoded, or NULL. */
+void tar_header(FILE *fp, const char *path, xfs_dinode_t *dinode, char type, uint64_t size,
+	const char *linkname, const char *pax)
+{
+	char *ext = NULL, val[64];
+	size_t n = 0;
+	uint32_t uid = GET32(dinode->di_core.di_uid), gid = GET32(dinode->di_core.di_gid);
+	uint64_t mtime = GET32(dinode->di_core.di_mtime.t_sec);
+
+	if(strlen(path) > 99) pax_add(&ext, &n, "path", path);
+	if(linkname && strlen(linkname) > 99) pax_add(&ext, &n, "linkpath", linkname);
+	if(size > 077777777777ULL) {
+		snprintf(val, sizeof(val), "%llu", (unsigned long long)size);
+		pax_add(&ext, &n, "size", val);
+	}
+	if(uid > 07777777) {
+		snprintf(val, sizeof(val), "%u", uid);
+		pax_add(&ext, &n, "uid", val);
+	}
+	if(gid > 07777777) {
+		snprintf(val, sizeof(val), "%u", gid);
+		pax_add(&ext, &n, "gid", val);
+	}
+	if(GET32(dinode->di_core.di_mtime.t_nsec)) {
+		snprintf(val, sizeof(val), "%llu.%09u", (unsigned long long)mtime, GET32(dinode->di_core.di_mtime.t_nsec));
+		pax_add(&ext, &n, "mtime", val);
+	}
+
+	if(pax) {
+		size_t plen = strlen(pax);
+		char *p = realloc(ext, n + plen + 1);
+		if(!p) { eprintf(ERR, "realloc() failed:"); exit(1); }
+		memcpy(p + n, pax, plen + 1);
+		ext = p;
+		n += plen;
+	}
+
+	if(n) {
+		const char *base = strrchr(path, '/');
+		base = base && base[1] ? base+1 : path;
+		char xname[100];
+		snprintf(xname, sizeof(xname), "PaxHeaders/%.80s", base);
+		tar_raw_header(fp, xname, 0644, 0, 0, n, mtime, 'x', NULL);
+		if(fwrite(ext, 1, n, fp) != n) eprintf(ERR, "Write to tar stream failed:");
+		tar_pad(fp, n);
+		free(ext);
+	}
+
+	tar_raw_header(fp, path, GET16(dinode->di_core.di_mode), uid > 07777777 ? 0 : uid,
+		gid > 07777777 ? 0 : gid, size > 077777777777ULL ? 0 : size,
+		mtime, type, linkname);
+}
+
+/* Encodes a GNU sparse map (pax format 0.1) for the extended header. */
+char *tar_sparse_pax(uint64_t realsize, const uint64_t *offs, const uint64_t *lens, size_t n)
+{
+	char *buf = NULL, *map = NULL, val[64];
+	size_t len = 0, maplen = 0, i;
+
+	for(i=0; i<n; i++) {
+		int l = snprintf(val, sizeof(val), "%s%llu,%llu", i ? "," : "",
+			(unsigned long long)offs[i], (unsigned long long)lens[i]);
+		char *p = realloc(map, maplen + l + 1);
+		if(!p) { eprintf(ERR, "realloc() failed:"); exit(1); }
+		memcpy(p + maplen, val, l + 1);
+		map = p;
+		maplen += l;
+	}
+
+	snprintf(val, sizeof(val), "%llu", (unsigned long long)realsize);
+	pax_add(&buf, &len, "GNU.sparse.size", val);
+	snprintf(val, sizeof(val), "%zu", n);
+	pax_add(&buf, &len, "GNU.sparse.numblocks", val);
+	pax_add(&buf, &len, "GNU.sparse.map", map ? map : "");
+	free(map);
+	return buf;
+}
+
+void tar_end(FILE *fp)
+{
+	static const char zeros[2*TAR_BLOCK];
+	if(fwrite(zeros, sizeof(zeros), 1, fp) != 1) eprintf(ERR, "Write to tar stream failed:");
+	fflush(fp);
+}
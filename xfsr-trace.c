@@ -0,0 +1,162 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Trace log. TRACE() stores a format pointer, a timestamp and four integers
+   in a ring owned by the calling thread; nothing is formatted there. A
+   writer thread drains the rings and prints the events to the log. When a
+   ring is full, events are dropped and counted rather than waited on. */
+
+#include "xfsr.h"
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define TRACE_RING 4096 /* events per thread, power of 2 */
+#define TRACE_IDLE_NS 5000000
+
+struct trace_ev {
+	const char *fmt;
+	uint64_t t;
+	uint64_t a[4];
+};
+
+/* Single producer (the owning thread), single consumer (the writer) */
+struct trace_ring {
+	struct trace_ev ev[TRACE_RING];
+	uint64_t head, tail;
+	uint64_t dropped, reported;
+	int free;
+	struct trace_ring *next;
+};
+
+static struct trace_ring *g_rings;
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_key;
+static pthread_t g_writer;
+static int g_writer_ok, g_stop;
+static uint64_t g_t0;
+static __thread struct trace_ring *t_ring;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Writes out what the rings hold; returns the number of events. */
+static size_t trace_drain(void)
+{
+	FILE *fp = log_fp();
+	size_t n = 0;
+	struct trace_ring *r;
+
+	pthread_mutex_lock(&g_rings_lock);
+	for(r=g_rings; r; r=r->next) {
+		uint64_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for(; tail != head; tail++, n++) {
+			const struct trace_ev *e = &r->ev[tail & (TRACE_RING-1)];
+			uint64_t t = e->t - g_t0;
+			fprintf(fp, "[TRACE] %llu.%06llu ", (unsigned long long)(t / 1000000000), (unsigned long long)(t / 1000 % 1000000));
+			fprintf(fp, e->fmt, e->a[0], e->a[1], e->a[2], e->a[3]);
+			fputc('\n', fp);
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		if(dropped != r->reported) {
+			fprintf(fp, "[TRACE] %llu events dropped\n", (unsigned long long)(dropped - r->reported));
+			r->reported = dropped;
+		}
+	}
+	pthread_mutex_unlock(&g_rings_lock);
+	if(n) fflush(fp);
+	return n;
+}
+
+static void *trace_writer(void *arg)
+{
+	struct timespec idle = { 0, TRACE_IDLE_NS };
+	while(!__atomic_load_n(&g_stop, __ATOMIC_ACQUIRE))
+		if(!trace_drain()) nanosleep(&idle, NULL);
+	return NULL;
+}
+
+static void trace_stop(void)
+{
+	__atomic_store_n(&g_stop, 1, __ATOMIC_RELEASE);
+	if(g_writer_ok) pthread_join(g_writer, NULL);
+	trace_drain();
+}
+
+/* The ring outlives its thread; the next new thread picks it up. */
+static void trace_release(void *ring)
+{
+	__atomic_store_n(&((struct trace_ring*)ring)->free, 1, __ATOMIC_RELEASE);
+}
+
+static void trace_init(void)
+{
+	g_t0 = now_ns();
+	log_fp(); /* open the log before the writer needs it */
+	pthread_key_create(&g_key, trace_release);
+	g_writer_ok = pthread_create(&g_writer, NULL, trace_writer, NULL) == 0;
+	if(!g_writer_ok) eprintf(WARN, "No trace writer thread, traces are written at exit");
+	atexit(trace_stop);
+}
+
+static struct trace_ring *trace_ring_get(void)
+{
+	struct trace_ring *r;
+	pthread_once(&g_once, trace_init);
+
+	pthread_mutex_lock(&g_rings_lock);
+	for(r=g_rings; r; r=r->next)
+		if(__atomic_load_n(&r->free, __ATOMIC_ACQUIRE)) break;
+	if(r) {
+		r->free = 0;
+	} else if((r = calloc(1, sizeof(*r)))) {
+		r->next = g_rings;
+		g_rings = r;
+	}
+	pthread_mutex_unlock(&g_rings_lock);
+
+	if(r) pthread_setspecific(g_key, r);
+	return t_ring = r;
+}
+
+void trace_emit(const char *fmt, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3)
+{
+	struct trace_ring *r = t_ring ? t_ring : trace_ring_get();
+	if(!r) return;
+
+	uint64_t head = r->head;
+	if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= TRACE_RING) {
+		__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct trace_ev *e = &r->ev[head & (TRACE_RING-1)];
+	e->fmt = fmt;
+	e->t = now_ns();
+	e->a[0] = a0, e->a[1] = a1, e->a[2] = a2, e->a[3] = a3;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,280 @@
+/*
+ *      XFS Rescue - tools for saving files from damaged XFS partitions
+ *
+ *      Copyright 2008 Utkan Gungordu <salviati@freeconsole.org>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Damage triage by sampling. Each AG is cut into strata of equal size, and
+   every round reads one random block from each stratum, in disk order, until
+   the sample or time budget runs out. The blocks are classified as in
+   xfsr-census; the inodes of inode blocks are checked one by one. Per AG,
+   the share of each block kind is estimated with a Wilson interval, and the
+   number of directories and files with a normal interval. Strata where
+   inodes or directory blocks were hit are printed as ranges worth a full
+   scan (xfsr-census -s/-e, xfsr-dirfind). */
+
+#include "xfsr.h"
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+#define TRIAGE_Z 1.96 /* 95% */
+
+enum kind { K_INODES, K_DIR, K_BMAP, K_BTREE, K_DATA, K_ZERO, K_UNREADABLE, K_BAD, K_NKINDS };
+
+static const char *g_kinds[K_NKINDS] = {
+	"inode_blocks", "dir_blocks", "bmap_blocks", "btree_blocks", "data", "zero", "unreadable", "bad",
+};
+
+/* Hits of one stratum */
+struct stratum {
+	uint32_t n, inodes, dirblocks;
+};
+
+/* Sums of one AG */
+struct agstat {
+	uint64_t n, count[K_NKINDS];
+	double dirs, dirs2, files, files2; /* per sampled block, and squares */
+};
+
+static const char *g_progname = "xfsr-triage";
+static uint64_t g_rng = 0x9e3779b97f4a7c15ULL;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*; the seed makes a sample repeatable */
+static uint64_t rnd(void)
+{
+	g_rng ^= g_rng >> 12;
+	g_rng ^= g_rng << 25;
+	g_rng ^= g_rng >> 27;
+	return g_rng * 0x2545f4914f6cdd1dULL;
+}
+
+static int kind_of(int type)
+{
+	switch(type & ~BT_BAD) {
+	case BT_INODES: return K_INODES;
+	case BT_DIR_BLOCK: case BT_DIR_DATA: case BT_DIR_LEAF: case BT_DA_NODE: case BT_DIR_FREE:
+		return K_DIR;
+	case BT_BMAP: return K_BMAP;
+	case BT_SB: case BT_AGF: case BT_AGI: case BT_AGFL: case BT_INOBT: case BT_FINOBT:
+	case BT_BNOBT: case BT_CNTBT: case BT_RMAPBT: case BT_REFCBT:
+		return K_BTREE;
+	case BT_ZERO: return K_ZERO;
+	case BT_UNREADABLE: return K_UNREADABLE;
+	default: return K_DATA;
+	}
+}
+
+/* Live directories and regular files among the inodes of an inode block */
+static void count_inodes(const unsigned char *blk, size_t len, unsigned *dirs, unsigned *files)
+{
+	unsigned inodesize = GET16(g_sb.sb_inodesize);
+	const unsigned char *p;
+	*dirs = *files = 0;
+	for(p=blk; p+inodesize <= blk+len; p+=inodesize) {
+		const xfs_dinode_t *dinode = (const xfs_dinode_t *)p;
+		if(GET16P(p) != XFS_DINODE_MAGIC || !inode_crc_ok(p)) continue;
+		if(dinode_isdir(dinode)) (*dirs)++;
+		else if(S_ISREG(GET16(dinode->di_core.di_mode))) (*files)++;
+	}
+}
+
+/* 95% Wilson score interval for k successes in n trials */
+static void wilson(uint64_t k, uint64_t n, double *lo, double *hi)
+{
+	if(!n) { *lo = 0, *hi = 1; return; }
+	double p = (double)k/n, z2 = TRIAGE_Z*TRIAGE_Z;
+	double d = 1 + z2/n;
+	double c = (p + z2/(2*n)) / d;
+	double h = TRIAGE_Z * sqrt(p*(1-p)/n + z2/(4.0*n*n)) / d;
+	*lo = c-h < 0 ? 0 : c-h;
+	*hi = c+h > 1 ? 1 : c+h;
+}
+
+/* Estimate of a per-block mean times nblocks, with a normal interval */
+static void print_mean(uint64_t ag, const char *what, uint64_t n, double sum, double sum2, uint64_t nblocks)
+{
+	double mean = n ? sum/n : 0, h = 0;
+	if(n > 1) {
+		double var = (sum2 - sum*mean) / (n-1);
+		h = TRIAGE_Z * sqrt(var > 0 ? var/n : 0);
+	}
+	double lo = mean-h < 0 ? 0 : mean-h;
+	printf("%llu\t%s\t%llu\t%.0f\t%.0f\t%.0f\n", (unsigned long long)ag, what, (unsigned long long)n, mean*nblocks, lo*nblocks, (mean+h)*nblocks);
+}
+
+/* Runs of strata with hits, as block ranges */
+static void print_ranges(uint64_t ag, const char *what, const struct stratum *st, unsigned nstrata,
+		uint64_t agstart, uint64_t aglen, int dirs)
+{
+	unsigned s, first;
+	for(s=0; s<nstrata; s++) {
+		if(!(dirs ? st[s].dirblocks : st[s].inodes)) continue;
+		uint32_t hits = 0;
+		for(first=s; s<nstrata && (dirs ? st[s].dirblocks : st[s].inodes); s++)
+			hits += dirs ? st[s].dirblocks : st[s].inodes;
+		printf("scan\t%llu\t%s\t0x%llx\t0x%llx\t%u\n", (unsigned long long)ag, what,
+			(unsigned long long)(agstart + aglen*first/nstrata), (unsigned long long)(agstart + aglen*s/nstrata), hits);
+	}
+}
+
+void usage()
+{
+	printf("Estimate per AG what survives from a random, stratified sample of blocks\n");
+	printf("usage: %s [-v -M -L logfile -n samples -S strata -t seconds -s seed] devfile\n", g_progname);
+	printf("-n is the total number of blocks to read (default 8192), -S the strata per AG\n");
+	printf("(default 64), -t stops early after that many seconds.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *devfile = NULL;
+	uint64_t nsamples = 8192;
+	unsigned nstrata = 64;
+	double budget = 0;
+
+	while( (c=getopt(argc,argv,"vML:n:S:t:s:")) != EOF ) {
+
+		switch(c) {
+		case 'v':
+			g_verbose++;
+			break;
+		case 'M':
+			g_devmmap = 1;
+			break;
+		case 'L':
+			g_logfile = optarg;
+			break;
+		case 'n':
+			nsamples = strtoull(optarg,0,0);
+			break;
+		case 'S':
+			nstrata = atoi(optarg);
+			break;
+		case 't':
+			budget = atof(optarg);
+			break;
+		case 's':
+			g_rng = strtoull(optarg,0,0) | 1;
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if(optind>=argc || nstrata < 1 || nsamples < 1) {
+		usage();
+		exit(0);
+	}
+
+	devfile = argv[optind];
+
+	FILE *devfp = dev_open(devfile);
+	if(!devfp) { perror(strerror(errno)); exit(errno); }
+
+	if(read_sb(devfp) <0) {
+		eprintf(ERR, "Not a valid superblock");
+		exit(2);
+	}
+	sb_print();
+
+	uint32_t blocksize = GET32(g_sb.sb_blocksize);
+	uint64_t agblocks = GET32(g_sb.sb_agblocks), dblocks = GET64(g_sb.sb_dblocks);
+	uint64_t agcount = (dblocks + agblocks-1) / agblocks, ag;
+	if(nstrata > agblocks) nstrata = agblocks;
+
+	struct stratum *st = calloc(agcount*nstrata, sizeof(*st));
+	struct agstat *as = calloc(agcount, sizeof(*as));
+	unsigned char *buf = malloc(blocksize);
+	if(!st || !as || !buf) { perror(strerror(errno)); exit(errno); }
+	dev_advise(DEV_RANDOM);
+
+	/* A round is one block per stratum, so stopping between rounds keeps the
+	   sample balanced */
+	double start = now();
+	uint64_t taken = 0;
+	while(taken < nsamples && !(budget > 0 && now() - start > budget)) {
+		for(ag=0; ag<agcount && taken<nsamples; ag++) {
+			uint64_t agstart = ag*agblocks;
+			uint64_t aglen = dblocks - agstart < agblocks ? dblocks - agstart : agblocks;
+			unsigned s;
+			for(s=0; s<nstrata && taken<nsamples; s++, taken++) {
+				uint64_t lo = aglen*s/nstrata, hi = aglen*(s+1)/nstrata;
+				if(hi <= lo) continue;
+				uint64_t blkadr = agstart + lo + rnd() % (hi-lo);
+				const unsigned char *blk = dev_get(devfp, blkadr << g_sb.sb_blocklog, blocksize, buf);
+				int type = blk ? census_classify(blk, blocksize, blkadr) : BT_UNREADABLE;
+				TRACE("triage: block 0x%llx is type %llu", blkadr, type);
+
+				struct stratum *sp = &st[ag*nstrata + s];
+				struct agstat *a = &as[ag];
+				int k = kind_of(type);
+				sp->n++;
+				a->n++;
+				a->count[k]++;
+				if(type & BT_BAD) a->count[K_BAD]++;
+				if(k == K_DIR) sp->dirblocks++;
+				if(k == K_INODES) {
+					unsigned dirs, files;
+					count_inodes(blk, blocksize, &dirs, &files);
+					sp->inodes++;
+					a->dirs += dirs, a->dirs2 += (double)dirs*dirs;
+					a->files += files, a->files2 += (double)files*files;
+				}
+			}
+		}
+	}
+	eprintf(INFO, "%llu blocks sampled in %.1f seconds", taken, now() - start);
+
+	printf("ag\tkind\tsampled\testimate\tlow\thigh\n");
+	for(ag=0; ag<agcount; ag++) {
+		uint64_t aglen = dblocks - ag*agblocks < agblocks ? dblocks - ag*agblocks : agblocks;
+		struct agstat *a = &as[ag];
+		int k;
+		for(k=0; k<K_NKINDS; k++) {
+			double lo, hi;
+			wilson(a->count[k], a->n, &lo, &hi);
+			printf("%llu\t%s\t%llu\t%.0f\t%.0f\t%.0f\n", (unsigned long long)ag, g_kinds[k], (unsigned long long)a->n,
+				a->n ? (double)a->count[k]/a->n*aglen : 0, lo*aglen, hi*aglen);
+		}
+		print_mean(ag, "dirs", a->n, a->dirs, a->dirs2, aglen);
+		print_mean(ag, "files", a->n, a->files, a->files2, aglen);
+	}
+
+	printf("scan\tag\tkind\tstartblk\tendblk\thits\n");
+	for(ag=0; ag<agcount; ag++) {
+		uint64_t aglen = dblocks - ag*agblocks < agblocks ? dblocks - ag*agblocks : agblocks;
+		print_ranges(ag, "inodes", &st[ag*nstrata], nstrata, ag*agblocks, aglen, 0);
+		print_ranges(ag, "dirs", &st[ag*nstrata], nstrata, ag*agblocks, aglen, 1);
+	}
+
+	free(st);
+	free(as);
+	free(buf);
+	return 0;
+}
@@ -22,15 +22,36 @@
 #include "xfsr.h"
 #include <stdarg.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
 
 int g_verbose=ERR;
 xfs_sb_t g_sb;
+int g_v5, g_ftype;
+const char *g_geometry;
 const char *g_logfile;
 static FILE *g_logfp = NULL;
+static pthread_once_t g_logonce = PTHREAD_ONCE_INIT;
 static const char *errtype_s[] = { "ERR", "WARN", "INFO" };
-static const char *inode_fmt_s[] = {"dev", "local", "extents", "btree", "uuid"};
 
-#define IN_INTERVAL(x,low,high)  ((x)>=(low) && (x)<=(high))
+static void log_open(void)
+{
+	if(g_logfile) {
+		g_logfp = fopen(g_logfile, "w+");
+		if(g_logfp == NULL) {
+			fprintf(stderr, "[!!!] Failed to open %s as log file: %s\n", g_logfile, strerror(errno));
+		}
+	}
+	if(g_logfp == NULL) g_logfp = stderr;
+}
+
+/* The log: -L logfile if it could be opened, stderr otherwise. It is opened
+   once, by whichever thread logs first. */
+FILE *log_fp(void)
+{
+	pthread_once(&g_logonce, log_open);
+	return g_logfp;
+}
 
 /* Hail thee, o patriarch Kernighan */
 void eprintf(enum errtype_e t, const char *fmt, ...)
@@ -38,44 +59,28 @@ void eprintf(enum errtype_e t, const char *fmt, ...)
 	if(g_verbose < t) return;
 	assert(t>=ERR && t<=INFO);
 
-	if(g_logfp == NULL) {
-		if(g_logfile) {
-			g_logfp = fopen(g_logfile, "w+");
-			if(g_logfp != NULL) {
-				fprintf(stderr, "[!!!] Failed to open %s as log file: %s\n", g_logfile, strerror(errno));
-			}
-		} else {
-			g_logfp = stderr;
-		}
-	}
-
-	fflush(stdout);
-	fprintf(g_logfp, "[%4s] ", errtype_s[t]);
+	int saved = errno;
+	FILE *fp = log_fp();
+	if(fp == stderr) fflush(stdout); /* keep the two in order on a terminal */
+	fprintf(fp, "[%4s] ", errtype_s[t]);
 	va_list args;
 	va_start(args,fmt);
-	vfprintf(g_logfp, fmt, args);
+	vfprintf(fp, fmt, args);
+	va_end(args);
 	if(t != INFO && fmt[0] != '\0' && fmt[strlen(fmt)-1] == ':')
-		fprintf(g_logfp, " %s", strerror(errno));
-	fprintf(g_logfp, "\n");
+		fprintf(fp, " %s", strerror(saved));
+	fputc('\n', fp);
 }
 
 void dinode_di_core_print(xfs_dinode_t *dinode)
 {
 	assert(dinode != NULL);
-	eprintf(INFO, "inode core info: ");
-	eprintf(INFO, "magic = 0x%x", GET16(dinode->di_core.di_magic));
-	eprintf(INFO, "mode = 0%o", GET16(dinode->di_core.di_mode));
-	eprintf(INFO, "version = %u", dinode->di_core.di_version);
-	eprintf(INFO, "format = %u (%s)", dinode->di_core.di_format,
-		IN_INTERVAL(dinode->di_core.di_format,0,4) ? inode_fmt_s[dinode->di_core.di_format] : "unknown");
-	eprintf(INFO, "uid = %u", GET32(dinode->di_core.di_uid));
-	eprintf(INFO, "gid = %u", GET32(dinode->di_core.di_gid));
-	eprintf(INFO, "size = 0x%llx", GET64(dinode->di_core.di_size));
-	eprintf(INFO, "nblocks = 0x%llx", GET64(dinode->di_core.di_nblocks));
-	eprintf(INFO, "extsize = 0x%x", GET32(dinode->di_core.di_extsize));
-	eprintf(INFO, "nextents = 0x%x", GET32(dinode->di_core.di_nextents));
-	eprintf(INFO, "aformat = %u (%s)", dinode->di_core.di_aformat,
-		IN_INTERVAL(dinode->di_core.di_aformat,0,4) ? inode_fmt_s[dinode->di_core.di_aformat] : "unknown");
+	TRACE("inode core: magic=0x%llx mode=0%llo version=%llu format=%llu", GET16(dinode->di_core.di_magic),
+		GET16(dinode->di_core.di_mode), dinode->di_core.di_version, dinode->di_core.di_format);
+	TRACE("inode core: uid=%llu gid=%llu size=0x%llx nblocks=0x%llx", GET32(dinode->di_core.di_uid),
+		GET32(dinode->di_core.di_gid), GET64(dinode->di_core.di_size), GET64(dinode->di_core.di_nblocks));
+	TRACE("inode core: extsize=0x%llx nextents=0x%llx aformat=%llu", GET32(dinode->di_core.di_extsize),
+		GET32(dinode->di_core.di_nextents), dinode->di_core.di_aformat);
 }
 
 /* Reads inode from disk into dinode, without any swap operation.
@@ -83,20 +88,309 @@ void dinode_di_core_print(xfs_dinode_t *dinode)
    File position is preserved. */
 int read_inode(FILE *fp, xfs_dinode_t *dinode, uint64_t iadr)
 {
-	off_t off = ftello(fp);
-	fseeko(fp, iadr << g_sb.sb_inodelog , SEEK_SET);
+	uint64_t off = iadr << g_sb.sb_inodelog;
 
-	if(dinode) {
-		fread(dinode, sizeof(xfs_dinode_t), 1, fp);
+	if(dinode && g_v5) {
+		unsigned inodesize = GET16(g_sb.sb_inodesize);
+		unsigned char buf[inodesize];
+		const unsigned char *p = dev_get(fp, off, inodesize, buf);
+		if(!p || GET16P(p) != XFS_DINODE_MAGIC)
+			return -1;
+		if(!inode_crc_ok(p))
+			eprintf(WARN, "Inode CRC mismatch at iadr=0x%llx", iadr);
+		memcpy(dinode, p, sizeof(xfs_dinode_t));
+	} else if(dinode) {
+		if(dev_read(fp, dinode, sizeof(xfs_dinode_t), off) < 0)
+			return -1;
 		if(GET16(dinode->di_core.di_magic) != XFS_DINODE_MAGIC)
 			return -1;
 	} else {
 		uint16_t magic;
-		fread(&magic,2,1,fp);
+		if(dev_read(fp, &magic, 2, off) < 0)
+			return -1;
 		if(GET16(magic) != XFS_DINODE_MAGIC)
 			return -1;
 	}
-	fseeko(fp, off, SEEK_SET);
+	return 0;
+}
+
+struct iref {
+	uint64_t iadr;
+	size_t idx;
+};
+
+static int iref_cmp(const void *a, const void *b)
+{
+	const struct iref *x = a, *y = b;
+	return x->iadr < y->iadr ? -1 : x->iadr > y->iadr;
+}
+
+/* Reads the cores of n inodes. The addresses are visited in disk order, and
+   inodes in the same or neighbouring clusters are fetched with one read of
+   at most INODE_BATCH_MAX bytes, so a directory whose children sit in a few
+   chunks costs a few reads rather than a seek per entry. ok[i] tells whether
+   dinodes[i] is valid. Returns the number of valid inodes. */
+int read_inodes(FILE *fp, const uint64_t *iadrs, size_t n, xfs_dinode_t *dinodes, char *ok)
+{
+	unsigned inodelog = g_sb.sb_inodelog;
+	unsigned cluster = GET32(g_sb.sb_blocksize) > INODE_CLUSTER_SIZE ? GET32(g_sb.sb_blocksize) : INODE_CLUSTER_SIZE;
+	uint64_t clustermask = ~(uint64_t)((cluster >> inodelog) - 1);
+	size_t i, j, k, nok = 0;
+
+	struct iref *s = malloc(n*sizeof(*s));
+	unsigned char *buf = malloc(INODE_BATCH_MAX);
+	if(!s || !buf) { eprintf(ERR, "malloc() failed:"); free(s); free(buf); return -1; }
+
+	for(i=0; i<n; i++) {
+		s[i].iadr = iadrs[i];
+		s[i].idx = i;
+		ok[i] = 0;
+	}
+	qsort(s, n, sizeof(*s), iref_cmp);
+
+	for(i=0; i<n; i=j) {
+		uint64_t first = s[i].iadr, last = first;
+		for(j=i+1; j<n; j++) {
+			if((s[j].iadr & clustermask) > (last & clustermask) + (cluster >> inodelog)) break;
+			if((s[j].iadr - first + 1) << inodelog > INODE_BATCH_MAX) break;
+			last = s[j].iadr;
+		}
+
+		size_t len = (last - first + 1) << inodelog;
+		const unsigned char *p = dev_get(fp, iadr_to_off(first), len, buf);
+		TRACE("inode batch: iadr=0x%llx, %llu inodes in %llu bytes, ok=%llu", first, j-i, len, p != NULL);
+		for(k=i; k<j; k++) {
+			xfs_dinode_t *d = &dinodes[s[k].idx];
+			if(p) {
+				const unsigned char *inode = &p[(s[k].iadr - first) << inodelog];
+				memcpy(d, inode, sizeof(*d));
+				if(GET16(d->di_core.di_magic) != XFS_DINODE_MAGIC) continue;
+				if(!inode_crc_ok(inode))
+					eprintf(WARN, "Inode CRC mismatch at iadr=0x%llx", s[k].iadr);
+			} else if(read_inode(fp, d, s[k].iadr) < 0) {
+				continue; /* short read near the end of the device */
+			}
+			ok[s[k].idx] = 1;
+			nok++;
+		}
+	}
+
+	free(s);
+	free(buf);
+	return (int)nok;
+}
+
+/* Inode-keyed hash table with fixed-size values, open addressing with
+   linear probing. Key 0 marks an empty slot (ino 0 is never valid). With
+   valsize 0 it is a set. */
+void inotab_init(inotab_t *t, size_t valsize)
+{
+	memset(t, 0, sizeof(*t));
+	t->valsize = valsize;
+}
+
+static inline size_t inotab_slot(const inotab_t *t, uint64_t ino)
+{
+	return (ino * 0x9E3779B97F4A7C15ULL) >> 32 & (t->cap - 1);
+}
+
+void *inotab_get(const inotab_t *t, uint64_t ino)
+{
+	if(!t->cap || !ino) return NULL;
+	size_t i;
+	for(i=inotab_slot(t, ino); t->keys[i]; i=(i+1) & (t->cap-1))
+		if(t->keys[i] == ino)
+			return t->valsize ? &t->vals[i*t->valsize] : (void*)&t->keys[i];
+	return NULL;
+}
+
+static int inotab_grow(inotab_t *t)
+{
+	inotab_t nt = *t;
+	nt.cap = t->cap ? 2*t->cap : 1024;
+	nt.n = 0;
+	nt.keys = calloc(nt.cap, sizeof(uint64_t));
+	nt.vals = t->valsize ? malloc(nt.cap*t->valsize) : NULL;
+	if(!nt.keys || (t->valsize && !nt.vals)) {
+		eprintf(ERR, "malloc() failed:");
+		free(nt.keys); free(nt.vals);
+		return -1;
+	}
+
+	size_t i;
+	for(i=0; i<t->cap; i++) {
+		if(!t->keys[i]) continue;
+		void *v = inotab_put(&nt, t->keys[i]);
+		if(t->valsize) memcpy(v, &t->vals[i*t->valsize], t->valsize);
+	}
+	free(t->keys);
+	free(t->vals);
+	*t = nt;
+	return 0;
+}
+
+/* Slot for ino's value, zeroed if ino is new. NULL if out of memory. */
+void *inotab_put(inotab_t *t, uint64_t ino)
+{
+	void *v = inotab_get(t, ino);
+	if(v || !ino) return v;
+	if(2*(t->n+1) > t->cap && inotab_grow(t) < 0) return NULL;
+
+	size_t i;
+	for(i=inotab_slot(t, ino); t->keys[i]; i=(i+1) & (t->cap-1))
+		;
+	t->keys[i] = ino;
+	t->n++;
+	if(!t->valsize) return &t->keys[i];
+	memset(&t->vals[i*t->valsize], 0, t->valsize);
+	return &t->vals[i*t->valsize];
+}
+
+void inotab_clear(inotab_t *t)
+{
+	if(t->cap) memset(t->keys, 0, t->cap*sizeof(uint64_t));
+	t->n = 0;
+}
+
+void inotab_free(inotab_t *t)
+{
+	free(t->keys);
+	free(t->vals);
+	inotab_init(t, t->valsize);
+}
+
+/* Reads a list of inode addresses, one per line, as printed by xfsr-dirfind
+   ("0x1f40"). Anything after the number is ignored; "-" reads stdin.
+   Returns the number of addresses, or -1. */
+int read_iadr_list(const char *path, uint64_t **list)
+{
+	FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if(!fp) { eprintf(ERR, "Failed to open %s:", path); return -1; }
+
+	size_t n = 0, cap = 0;
+	uint64_t *l = NULL;
+	char line[512];
+	while(fgets(line, sizeof(line), fp)) {
+		char *end;
+		uint64_t iadr = strtoull(line, &end, 16);
+		if(end == line) continue;
+		if(n == cap) {
+			cap = cap ? 2*cap : 1024;
+			uint64_t *nl = realloc(l, cap*sizeof(uint64_t));
+			if(!nl) { eprintf(ERR, "realloc() failed:"); free(l); return -1; }
+			l = nl;
+		}
+		l[n++] = iadr;
+	}
+	if(fp != stdin) fclose(fp);
+	*list = l;
+	return (int)n;
+}
+
+/* Picks up the feature bits that change on-disk layouts. raw holds the
+   first len bytes of the superblock. */
+void sb_features(const unsigned char *raw, size_t len)
+{
+	uint16_t version = GET16P(&raw[0x64]);
+	uint32_t features2 = GET32P(&raw[0xc8]);
+	unsigned sectsize = GET16(g_sb.sb_sectsize);
+
+	g_v5 = (version & XFS_SB_VERSION_NUMBITS) == 5;
+	if(g_v5) {
+		g_ftype = GET32P(&raw[0xd8]) & 1; /* sb_features_incompat */
+		if(sectsize < 512 || sectsize > len || !xfs_cksum_ok(raw, sectsize, 0xe0))
+			eprintf(WARN, "Superblock CRC mismatch");
+	} else {
+		g_ftype = (version & 0x8000) && (features2 & 0x200); /* MOREBITS, VERSION2_FTYPE */
+	}
+}
+
+const sbfield_t g_sbfields[SB_NFIELDS] = {
+	{ "blocksize", offsetof(xfs_sb_t, sb_blocksize), 4 },
+	{ "dblocks", offsetof(xfs_sb_t, sb_dblocks), 8 },
+	{ "agblocks", offsetof(xfs_sb_t, sb_agblocks), 4 },
+	{ "agcount", offsetof(xfs_sb_t, sb_agcount), 4 },
+	{ "sectsize", offsetof(xfs_sb_t, sb_sectsize), 2 },
+	{ "inodesize", offsetof(xfs_sb_t, sb_inodesize), 2 },
+	{ "logstart", offsetof(xfs_sb_t, sb_logstart), 8 },
+	{ "logblocks", offsetof(xfs_sb_t, sb_logblocks), 4 },
+	{ "rootino", offsetof(xfs_sb_t, sb_rootino), 8 },
+	{ "versionnum", offsetof(xfs_sb_t, sb_versionnum), 2 },
+};
+
+uint64_t sb_get(const xfs_sb_t *sb, const sbfield_t *f)
+{
+	const unsigned char *p = (const unsigned char *)sb + f->off;
+	return f->size == 8 ? GET64P(p) : f->size == 4 ? GET32P(p) : GET16P(p);
+}
+
+void sb_set(xfs_sb_t *sb, const sbfield_t *f, uint64_t v)
+{
+	unsigned char *p = (unsigned char *)sb + f->off;
+	if(f->size == 8) *(uint64_t *)p = GET64(v);
+	else if(f->size == 4) *(uint32_t *)p = GET32((uint32_t)v);
+	else *(uint16_t *)p = GET16((uint16_t)v);
+}
+
+/* log2 of a power of two, -1 for anything else */
+static int exact_log2(uint64_t v)
+{
+	int l = 0;
+	if(!v || (v & (v-1))) return -1;
+	while(v >>= 1) l++;
+	return l;
+}
+
+/* Loads a geometry file as written by sb_save() into g_sb, and works out
+   the fields the tools derive from it. */
+int sb_load(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if(!fp) { eprintf(ERR, "Failed to open %s:", path); return -1; }
+
+	char line[256], name[64];
+	unsigned long long v;
+	unsigned i;
+	memset(&g_sb, 0, sizeof(g_sb));
+	g_ftype = 0;
+	while(fgets(line, sizeof(line), fp)) {
+		if(line[0] == '#' || sscanf(line, "%63s %lli", name, &v) != 2) continue;
+		if(!strcmp(name, "ftype")) { g_ftype = !!v; continue; }
+		for(i=0; i<SB_NFIELDS; i++)
+			if(!strcmp(name, g_sbfields[i].name)) sb_set(&g_sb, &g_sbfields[i], v);
+	}
+	fclose(fp);
+
+	uint32_t agblocks = GET32(g_sb.sb_agblocks);
+	int blocklog = exact_log2(GET32(g_sb.sb_blocksize)), sectlog = exact_log2(GET16(g_sb.sb_sectsize));
+	int inodelog = exact_log2(GET16(g_sb.sb_inodesize));
+	if(blocklog < 9 || blocklog > 16 || sectlog < 9 || sectlog > 15 || inodelog < 8 || inodelog > 11 ||
+			inodelog > blocklog || !agblocks || !GET32(g_sb.sb_agcount) || !GET64(g_sb.sb_dblocks)) {
+		eprintf(ERR, "%s: bad or missing geometry", path);
+		return -1;
+	}
+	g_sb.sb_magicnum = GET32(XFS_SB_MAGIC);
+	g_sb.sb_blocklog = blocklog;
+	g_sb.sb_sectlog = sectlog;
+	g_sb.sb_inodelog = inodelog;
+	g_sb.sb_inopblog = blocklog - inodelog;
+	g_sb.sb_inopblock = GET16((uint16_t)(1 << (blocklog - inodelog)));
+	for(g_sb.sb_agblklog = 0; (1ULL << g_sb.sb_agblklog) < agblocks; g_sb.sb_agblklog++);
+	g_v5 = (GET16(g_sb.sb_versionnum) & XFS_SB_VERSION_NUMBITS) == 5;
+	eprintf(INFO, "Geometry from %s", path);
+	return 0;
+}
+
+int sb_save(const char *path)
+{
+	FILE *fp = fopen(path, "w");
+	if(!fp) { eprintf(ERR, "Failed to create %s:", path); return -1; }
+	unsigned i;
+	fprintf(fp, "# xfsr geometry, give it to the tools as devfile,geom=%s\n", path);
+	for(i=0; i<SB_NFIELDS; i++)
+		fprintf(fp, "%s\t%llu\n", g_sbfields[i].name, (unsigned long long)sb_get(&g_sb, &g_sbfields[i]));
+	fprintf(fp, "ftype\t%d\n", g_ftype);
+	if(fclose(fp) != 0) { eprintf(ERR, "Failed to write %s:", path); return -1; }
 	return 0;
 }
 
@@ -113,6 +407,7 @@ void sb_print()
 	eprintf(INFO, "Superblock info: ");
  	eprintf(INFO, "blocklog = %u", g_sb.sb_blocklog);
  	eprintf(INFO, "inodelog = %u", g_sb.sb_inodelog);
+	eprintf(INFO, "version = %u%s", GET16(g_sb.sb_versionnum) & XFS_SB_VERSION_NUMBITS, g_ftype ? ", ftype" : "");
 }
 
 void
@@ -30,6 +30,7 @@
 # include <stdint.h>
 # include <stdio.h>
 # include <errno.h>
+# include <string.h>
 //# include <byteswap.h>
 
 /* Note that iadr/blkadr, the inode/block "address" is not the inode/block's
@@ -38,6 +39,9 @@ physical address on disk, but rather address divided by inodesize/blocksize. */
 extern xfs_sb_t g_sb;
 extern int g_verbose;
 extern const char *g_logfile;
+extern int g_v5;    /* v5 superblock: v3 inodes, self-describing CRC'd metadata */
+extern int g_ftype; /* directory entries carry a file type byte */
+extern const char *g_geometry; /* geometry file standing in for the superblock */
 
 #undef NDEBUG
 
@@ -59,8 +63,34 @@ extern const char *g_logfile;
 enum errtype_e {ERR, WARN, INFO};
 void eprintf(enum errtype_e t, const char *fmt, ...);
 //#define eprintf(t,fmt,...) eprintf(__func__ , __VA_ARGS__)
+FILE *log_fp(void);
 
-#define INO_DATA_FORK_OFFSET 0x64
+/* Trace points for hot paths (xfsr-trace.c), on at the same verbosity as
+   INFO. Up to four integer arguments, all passed as 64 bits, so the format
+   may only use %ll conversions. Build with -DXFSR_NOTRACE to compile them
+   out. */
+void trace_emit(const char *fmt, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3);
+#ifdef XFSR_NOTRACE
+# define TRACE(...) do { } while(0)
+#else
+# define TRACE(...) TRACE_(__VA_ARGS__, 0, 0, 0, 0)
+# define TRACE_(fmt, a0, a1, a2, a3, ...) do { if(g_verbose >= INFO) \
+	trace_emit(fmt, (uint64_t)(a0), (uint64_t)(a1), (uint64_t)(a2), (uint64_t)(a3)); } while(0)
+#endif
+
+#define INO_V2_FORK_OFFSET 0x64
+#define INO_V3_FORK_OFFSET 0xb0
+#define INO_DATA_FORK_OFFSET (g_v5 ? INO_V3_FORK_OFFSET : INO_V2_FORK_OFFSET)
+#define INO_CRC_OFFSET 0x64 /* v3 only */
+
+/* v5 metadata magics, not in the xfsprogs 2.9.8 headers */
+#define XFS_DIR3_BLOCK_MAGIC 0x58444233 /* XDB3 */
+#define XFS_DIR3_DATA_MAGIC 0x58444433 /* XDD3 */
+#define XFS_BMAP_CRC_MAGIC 0x424d4133 /* BMA3 */
+#define XFS_SYMLINK_MAGIC 0x58534c4d /* XSLM */
+#define XFS_SYMLINK_HDR_SIZE 56
+#define INODE_CLUSTER_SIZE 8192 /* XFS_INODE_BIG_CLUSTER_SIZE */
+#define INODE_BATCH_MAX (256<<10)
 
 static inline uint64_t ino_to_iadr(uint64_t ino)
 {
@@ -116,30 +146,214 @@ static inline void seek_ino(FILE *fp, uint64_t ino)
 	seek_iadr(fp, ino_to_iadr(ino));
 }
 
+/* Byte offsets on the device, for dev_get() */
+static inline uint64_t blkno_to_off(uint64_t blkno)
+{
+	return blkno_to_blkadr(blkno) << g_sb.sb_blocklog;
+}
+
+static inline uint64_t iadr_to_off(uint64_t iadr)
+{
+	return iadr << g_sb.sb_inodelog;
+}
+
+void sb_features(const unsigned char *raw, size_t len);
+int sb_load(const char *path);
+int sb_save(const char *path);
+
+/* The superblock fields a geometry file holds */
+typedef struct sbfield {
+	const char *name;
+	size_t off, size;
+} sbfield_t;
+
+#define SB_NFIELDS 10
+extern const sbfield_t g_sbfields[SB_NFIELDS];
+uint64_t sb_get(const xfs_sb_t *sb, const sbfield_t *f);
+void sb_set(xfs_sb_t *sb, const sbfield_t *f, uint64_t v);
+
+/* With a geom= element in the devfile, the geometry file written by
+   xfsr-probe is used instead of the primary superblock. */
 static inline int read_sb(FILE *fp)
 {
+	unsigned char raw[4096]; /* room for the largest sector, for the v5 CRC */
+	if(g_geometry) return sb_load(g_geometry);
 	off_t off = ftello(fp);
-	fread(&g_sb, sizeof(xfs_sb_t), 1, fp);
+	size_t n = fread(raw, 1, sizeof(raw), fp);
 	fseeko(fp, off, SEEK_SET);
-	if(g_sb.sb_magicnum == XFS_SB_MAGIC) return -1;
+	memcpy(&g_sb, raw, sizeof(xfs_sb_t));
+	if(GET32(g_sb.sb_magicnum) != XFS_SB_MAGIC) {
+		eprintf(WARN, "Bad superblock magic, xfsr-probe can recover the geometry");
+		return -1;
+	}
+	sb_features(raw, n);
 	return 0;
 }
 
-static inline int dinode_isdir(xfs_dinode_t *dinode)
+static inline int dinode_isdir(const xfs_dinode_t *dinode)
 {
 	uint16_t mode = GET16(dinode->di_core.di_mode);
-	if(!S_ISDIR(mode) || dinode->di_core.di_version != 2) return 0;
+	if(!S_ISDIR(mode) || dinode->di_core.di_version != (g_v5 ? 3 : 2)) return 0;
 	if(dinode->di_core.di_format <1 || dinode->di_core.di_format>3) return 0;
 	return dinode->di_core.di_format;
 }
 
+/* Size of the data fork in bytes, as limited by an attribute fork. */
+static inline unsigned dinode_dfork_size(const xfs_dinode_t *dinode)
+{
+	if(dinode->di_core.di_forkoff)
+		return dinode->di_core.di_forkoff << 3;
+	return GET16(g_sb.sb_inodesize) - INO_DATA_FORK_OFFSET;
+}
+
 void dinode_di_core_print(xfs_dinode_t *dinode);
 void sb_print();
 int read_inode(FILE *fp, xfs_dinode_t *dinode, uint64_t iadr);
+int read_inodes(FILE *fp, const uint64_t *iadrs, size_t n, xfs_dinode_t *dinodes, char *ok);
+int read_iadr_list(const char *path, uint64_t **list);
+
+typedef struct inotab {
+	uint64_t *keys;
+	unsigned char *vals;
+	size_t valsize, n, cap;
+} inotab_t;
+
+void inotab_init(inotab_t *t, size_t valsize);
+void *inotab_get(const inotab_t *t, uint64_t ino);
+void *inotab_put(inotab_t *t, uint64_t ino);
+void inotab_clear(inotab_t *t);
+void inotab_free(inotab_t *t);
 
 void __xfs_bmbt_get_all(__uint64_t l0, __uint64_t l1, xfs_bmbt_irec_t *s);
 void xfs_bmbt_get_all(xfs_bmbt_rec_64_t *r, xfs_bmbt_irec_t *s);
 void xfs_bmbt_disk_get_all(xfs_bmbt_rec_64_t *r, xfs_bmbt_irec_t *s);
 
+/* xfsr-crc.c */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+int xfs_cksum_ok(const void *buf, size_t len, size_t off);
+
+/* inode points to all inodesize bytes; always true before v5 */
+static inline int inode_crc_ok(const unsigned char *inode)
+{
+	return !g_v5 || xfs_cksum_ok(inode, GET16(g_sb.sb_inodesize), INO_CRC_OFFSET);
+}
+
+/* xfsr-dev.c */
+#define DEV_RANDOM 0
+#define DEV_SEQUENTIAL 1
+extern int g_devmmap;
+FILE *dev_open(const char *path);
+void dev_advise(int pattern);
+const unsigned char *dev_get(FILE *fp, uint64_t off, size_t len, void *buf);
+int dev_read(FILE *fp, void *buf, size_t len, uint64_t off);
+
+/* xfsr-dir.c */
+/* Entries of one directory, names packed into one buffer */
+typedef struct dirlist {
+	uint64_t *ino;
+	size_t *nameoff;
+	size_t n, cap;
+	char *names;
+	size_t namesize, namecap;
+} dirlist_t;
+
+int dirlist_add(dirlist_t *dl, uint64_t ino, const char *name);
+void dirlist_free(dirlist_t *dl);
+int dir_collect(FILE *fp, uint64_t iadr, xfs_dinode_t *dinode, dirlist_t *dl);
+
+/* xfsr-census.c */
+/* Block types in a census map, one byte per block */
+enum census_bt {
+	BT_UNSCANNED, BT_UNREADABLE, BT_ZERO, BT_DATA, BT_SB, BT_AGF, BT_AGI, BT_AGFL,
+	BT_INOBT, BT_FINOBT, BT_BNOBT, BT_CNTBT, BT_RMAPBT, BT_REFCBT, BT_BMAP, BT_INODES,
+	BT_DIR_BLOCK, BT_DIR_DATA, BT_DIR_LEAF, BT_DA_NODE, BT_DIR_FREE, BT_ATTR_LEAF, BT_SYMLINK,
+	BT_NTYPES
+};
+#define BT_BAD 0x80 /* or'ed in when the header fails its checks */
+
+int census_classify(const unsigned char *blk, size_t len, uint64_t blkadr);
+const char *census_name(unsigned type);
+int census_type(const char *name);
+uint8_t *census_load(const char *path, int writable, uint64_t *nblocks);
+
+/* xfsr-bitmap.c */
+/* One bit per block, compressed per 64K block chunk */
+typedef struct bitmap {
+	uint64_t nblocks;
+	uint32_t blocksize;
+	size_t nchunks;
+	struct bm_chunk *chunks;
+} bitmap_t;
+
+int bitmap_init(bitmap_t *bm, uint64_t nblocks, uint32_t blocksize);
+void bitmap_free(bitmap_t *bm);
+int bitmap_set_range(bitmap_t *bm, uint64_t start, uint64_t len, bitmap_t *dup);
+int bitmap_test(const bitmap_t *bm, uint64_t b);
+uint64_t bitmap_next(const bitmap_t *bm, uint64_t from, int set);
+uint64_t bitmap_count(const bitmap_t *bm);
+uint64_t bitmap_count_range(const bitmap_t *bm, uint64_t start, uint64_t len);
+int bitmap_save(const bitmap_t *bm, const char *path);
+int bitmap_load(bitmap_t *bm, const char *path);
+
+/* xfsr-agwalk.c */
+/* Callbacks for what a walk finds; meta and free may be NULL. Without
+   inode, the inode btrees are left alone. */
+typedef struct agwalk {
+	void (*meta)(uint64_t blkadr, uint64_t len); /* headers, btree and free list blocks, inode chunks */
+	void (*free)(uint64_t blkadr, uint64_t len); /* free extents */
+	void (*inode)(uint64_t iadr); /* allocated inodes */
+	uint64_t bad; /* damaged structures met */
+} agwalk_t;
+
+void agwalk(FILE *fp, uint64_t ag, agwalk_t *w);
+
+/* xfsr-index.c */
+int index_open(const char *path);
+int index_search(FILE *out, const char *query, int isregex, int icase, void (*putname)(FILE *out, const char *name));
+
+/* xfsr-hash.c */
+typedef struct xxh64 {
+	uint64_t v[4];
+	uint64_t total;
+	unsigned char mem[32];
+	unsigned memsize;
+} xxh64_t;
+
+void xxh64_init(xxh64_t *s);
+void xxh64_update(xxh64_t *s, const void *data, size_t len);
+uint64_t xxh64_digest(const xxh64_t *s);
+
+/* xfsr-tar.c */
+void tar_header(FILE *fp, const char *path, xfs_dinode_t *dinode, char type, uint64_t size,
+	const char *linkname, const char *pax);
+char *tar_sparse_pax(uint64_t realsize, const uint64_t *offs, const uint64_t *lens, size_t n);
+void tar_pad(FILE *fp, uint64_t size);
+void tar_end(FILE *fp);
+
+/* xfsr-extmap.c */
+#define EXTMAP_MAXRECS (1u<<22)
+#define EXTMAP_MAXLEVELS 8
+
+/* Decoded data fork; entry i is the i'th extent. startblock is a blkno. */
+typedef struct extmap {
+	uint64_t *startoff;
+	uint64_t *startblock;
+	uint32_t *count;
+	uint8_t *state;
+	size_t n, cap;
+	unsigned char *buf;
+	size_t bufsize;
+	uint64_t *bmblk; /* blknos of the bmap B+ tree blocks read */
+	size_t nbmblk, bmcap;
+} extmap_t;
+
+void extmap_init(extmap_t *m);
+void extmap_free(extmap_t *m);
+void extmap_reset(extmap_t *m);
+int extmap_decode(extmap_t *m, const xfs_bmbt_rec_64_t *recs, size_t n);
+void extmap_merge(extmap_t *m);
+int extmap_load_inode(FILE *fp, const unsigned char *inode, xfs_dinode_t *dinode, extmap_t *m);
+int extmap_load(FILE *fp, uint64_t iadr, xfs_dinode_t *dinode, extmap_t *m);
+
 
 #endif